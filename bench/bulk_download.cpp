@@ -0,0 +1,81 @@
+// Compares downloadToFile() throughput through libcurl's write callback and
+// through the splice(2) bulk path, against a local ReplayServer (plaintext
+// HTTP/1.1 over loopback, so the network is not the bottleneck).
+//
+// Usage: ./build/bench_bulk_download [size MiB] [rounds]
+
+#include "curling.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+struct Result {
+    double mibPerSecond;
+    bool spliced;
+    curling::HdrHistogram rounds; // per transfer, us
+};
+
+Result run(const std::string& url, const std::string& path, size_t size, unsigned rounds, bool bulk) {
+    curling::Request req;
+    req.setPersistent().setBulkDownload(bulk).setURL(url).downloadToFile(path);
+    req.send(); // warm-up: page cache, connection
+
+    curling::HdrHistogram latency(600ULL * 1000 * 1000, 3);
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for (unsigned i = 0; i < rounds; ++i) {
+        curling::Response res = req.send();
+        if (res.httpCode != 200) {
+            std::cerr << "unexpected status " << res.httpCode << "\n";
+            std::exit(1);
+        }
+        auto now = std::chrono::steady_clock::now();
+        latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count()));
+        last = now;
+    }
+    double seconds = std::chrono::duration<double>(last - start).count();
+    return {static_cast<double>(size) * rounds / (1024.0 * 1024.0) / seconds,
+            req.getDownloadPath() == curling::Request::TransferPath::Splice, std::move(latency)};
+}
+
+void report(const char* name, const Result& r) {
+    std::cout << std::left << std::setw(16) << name
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << r.mibPerSecond
+              << std::setw(10) << (r.spliced ? "splice" : "copy")
+              << std::setw(12) << std::setprecision(1) << r.rounds.percentile(50.0) / 1000.0
+              << std::setw(12) << r.rounds.max() / 1000.0 << "\n";
+}
+
+int main(int argc, char** argv) {
+    size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+    unsigned rounds = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : 5;
+
+    curling::Exchange artifact;
+    artifact.method = "GET";
+    artifact.url = "/artifact.bin";
+    artifact.httpCode = 200;
+    artifact.responseHeaders = {"Content-Type: application/octet-stream"};
+    artifact.responseBody.assign(mib * 1024 * 1024, 'a');
+    curling::TrafficLog log;
+    log.exchanges.push_back(artifact);
+    curling::ReplayServer server(log, 0.0);
+
+    const std::string url = server.url() + "/artifact.bin";
+    const std::string path = "/tmp/curling_bench_bulk.bin";
+
+    std::cout << "curling " << curling::version() << " bulk download, " << mib << " MiB x " << rounds
+              << " (ReplayServer, loopback)\n";
+    std::cout << curling::capabilities() << "\n";
+    std::cout << std::left << std::setw(16) << "case"
+              << std::right << std::setw(12) << "MiB/s" << std::setw(10) << "path"
+              << std::setw(12) << "p50 ms" << std::setw(12) << "max ms" << "\n";
+
+    report("write callback", run(url, path, artifact.responseBody.size(), rounds, false));
+    report("bulk (splice)", run(url, path, artifact.responseBody.size(), rounds, true));
+
+    std::remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Measures curling's own per-request overhead (request building, callbacks,
+// header parsing, response assembly) using the in-process mock transport,
+// so no DNS, socket or server time is included.
+//
+// Usage: ./build/bench_overhead [iterations]
+
+#include "curling.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// ---- allocation counting (glibc: every heap allocation, C++ and libcurl, ends up in malloc) ----
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static std::atomic<unsigned long> allocations{0};
+
+extern "C" void* malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+extern "C" void* calloc(size_t n, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+extern "C" void* realloc(void* p, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+static unsigned long allocationCount() { return allocations.load(std::memory_order_relaxed); }
+#else
+static unsigned long allocationCount() { return 0; } // not counted on this platform
+#endif
+
+struct Result {
+    double nsPerRequest;
+    double allocsPerRequest;
+    curling::HdrHistogram latency; // per request, ns (includes two clock reads)
+};
+
+template<typename Build>
+Result run(unsigned iterations, Build build) {
+    curling::Request req;
+
+    // warm-up
+    for (unsigned i = 0; i < iterations / 10 + 1; ++i) {
+        build(req);
+        req.send();
+    }
+
+    curling::HdrHistogram latency(1000ULL * 1000 * 1000, 3); // up to 1 s
+    unsigned long allocsBefore = allocationCount();
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for (unsigned i = 0; i < iterations; ++i) {
+        build(req);
+        curling::Response res = req.send();
+        if (res.httpCode != 200) {
+            std::cerr << "unexpected status " << res.httpCode << "\n";
+            std::exit(1);
+        }
+        auto now = std::chrono::steady_clock::now();
+        latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count()));
+        last = now;
+    }
+    auto elapsed = last - start;
+    unsigned long allocs = allocationCount() - allocsBefore;
+
+    return {
+        std::chrono::duration<double, std::nano>(elapsed).count() / iterations,
+        static_cast<double>(allocs) / iterations,
+        std::move(latency)
+    };
+}
+
+void report(const char* name, const Result& r) {
+    std::cout << std::left << std::setw(16) << name
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << r.nsPerRequest
+              << std::setw(14) << std::setprecision(1) << r.allocsPerRequest
+              << std::setw(10) << r.latency.percentile(50.0) << std::setw(10) << r.latency.percentile(99.0)
+              << std::setw(10) << r.latency.percentile(99.9) << "\n";
+}
+
+int main(int argc, char** argv) {
+    unsigned iterations = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 20000;
+
+    auto small = std::make_shared<curling::MockResponse>();
+    small->body = R"({"status":"ok","items":[]})";
+    small->headers = {"Content-Type: application/json", "Content-Length: " + std::to_string(small->body.size())};
+
+    auto heavy = std::make_shared<curling::MockResponse>();
+    for (int i = 0; i < 30; ++i) {
+        heavy->headers.push_back("X-Header-" + std::to_string(i) + ": value-" + std::to_string(i));
+    }
+    heavy->body = std::string(64 * 1024, 'x');
+
+    std::cout << "curling " << curling::version() << " overhead, " << iterations << " iterations (mock transport)\n";
+    std::cout << curling::capabilities() << "\n";
+    std::cout << std::left << std::setw(16) << "case"
+              << std::right << std::setw(12) << "ns/req" << std::setw(14) << "allocs/req"
+              << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns" << std::setw(10) << "p99.9 ns" << "\n";
+
+    report("GET", run(iterations, [&](curling::Request& req) {
+        req.setMockResponse(small)
+           .setURL("http://bench.local/v1/items")
+           .addArg("page", "1");
+    }));
+
+    report("POST json", run(iterations, [&](curling::Request& req) {
+        req.setMockResponse(small)
+           .setMethod(curling::Request::Method::POST)
+           .setURL("http://bench.local/v1/items")
+           .addHeader("Content-Type: application/json")
+           .setBody(R"({"name":"widget","qty":3})");
+    }));
+
+    report("headers-heavy", run(iterations, [&](curling::Request& req) {
+        req.setMockResponse(heavy).setURL("http://bench.local/v1/blob");
+        for (int i = 0; i < 10; ++i) {
+            req.addHeader("X-Request-Header-" + std::to_string(i) + ": some-value");
+        }
+    }));
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Download throughput for several SO_RCVBUF sizes (SocketOptions::receiveBuffer),
+// against a local ReplayServer (plaintext HTTP/1.1 over loopback). Each round
+// opens a new connection, so every transfer runs with the configured buffer.
+//
+// Usage: ./build/bench_socket_buffers [size MiB] [rounds]
+
+#include "curling.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+struct Result {
+    double mibPerSecond;
+    curling::HdrHistogram rounds; // per transfer, us
+};
+
+Result run(const std::string& url, size_t size, unsigned rounds, int receiveBuffer) {
+    curling::SocketOptions options;
+    options.receiveBuffer = receiveBuffer;
+
+    auto once = [&] {
+        // A fresh Request per round: new handle, new connection
+        curling::BasicRequest<curling::NullSink, curling::NoHeaders> req;
+        req.setSocketOptions(options).setURL(url);
+        if (req.send().httpCode != 200) {
+            std::cerr << "unexpected status\n";
+            std::exit(1);
+        }
+    };
+    once(); // warm-up
+
+    curling::HdrHistogram latency(600ULL * 1000 * 1000, 3);
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for (unsigned i = 0; i < rounds; ++i) {
+        once();
+        auto now = std::chrono::steady_clock::now();
+        latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count()));
+        last = now;
+    }
+    double seconds = std::chrono::duration<double>(last - start).count();
+    return {static_cast<double>(size) * rounds / (1024.0 * 1024.0) / seconds, std::move(latency)};
+}
+
+int main(int argc, char** argv) {
+    size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    unsigned rounds = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : 5;
+
+    curling::Exchange artifact;
+    artifact.method = "GET";
+    artifact.url = "/artifact.bin";
+    artifact.httpCode = 200;
+    artifact.responseHeaders = {"Content-Type: application/octet-stream"};
+    artifact.responseBody.assign(mib * 1024 * 1024, 'a');
+    curling::TrafficLog log;
+    log.exchanges.push_back(artifact);
+    curling::ReplayServer server(log, 0.0);
+    const std::string url = server.url() + "/artifact.bin";
+
+    std::cout << "curling " << curling::version() << " socket receive buffers, " << mib << " MiB x " << rounds
+              << " (ReplayServer, loopback)\n";
+    std::cout << curling::capabilities() << "\n";
+    std::cout << std::left << std::setw(16) << "SO_RCVBUF"
+              << std::right << std::setw(12) << "MiB/s" << std::setw(12) << "p50 ms" << std::setw(12) << "max ms" << "\n";
+
+    const std::pair<const char*, int> cases[] = {
+        {"default", 0}, {"64 KiB", 64 * 1024}, {"256 KiB", 256 * 1024}, {"1 MiB", 1024 * 1024}, {"4 MiB", 4 * 1024 * 1024},
+    };
+    for (const auto& c : cases) {
+        Result r = run(url, artifact.responseBody.size(), rounds, c.second);
+        std::cout << std::left << std::setw(16) << c.first
+                  << std::right << std::setw(12) << std::fixed << std::setprecision(0) << r.mibPerSecond
+                  << std::setw(12) << std::setprecision(1) << r.rounds.percentile(50.0) / 1000.0
+                  << std::setw(12) << r.rounds.max() / 1000.0 << "\n";
+    }
+    return 0;
+}
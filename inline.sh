@@ -1,12 +1,14 @@
 #!/bin/bash
 # Script: inline.sh
 # Purpose: Modifies a C++ header file by inserting the `inline` keyword before each
-# member function definition of the `curling::Request` class.
+# out-of-class member function definition (e.g. `curling::Request`, `curling::RefreshingTokenProvider`).
 # Notes: This is useful when using header-only libraries to prevent multiple definition errors
 # during the linking phase when including the header in multiple translation units.
+# Only definitions starting at column 0 are touched, so calls inside function bodies
+# and doc comments are left alone.
 
-sed -i '/Request::/ {
-  /^[[:space:]]*inline/ ! {
-    /(\|);$/ s/^[[:space:]]*/&inline /
+sed -i -E '/^([A-Za-z_][A-Za-z0-9_:<>,&* ]* )?([A-Z][A-Za-z0-9_]*::)+~?[A-Za-z_][A-Za-z0-9_]*(\(| *=)/ {
+  /^(inline|static_assert|return|using|namespace|template)\b/ ! {
+    s/^/inline /
   }
 }' ./header_only/curling.hpp
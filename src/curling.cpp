@@ -4,6 +4,25 @@
 
 #include "curling.hpp"
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cmath>
+#include <new>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
 namespace curling {
 
 Request::Request() : method(Method::GET), curlHandle(nullptr), list(nullptr), cookieFile(""), cookieJar("") {
@@ -16,10 +35,13 @@ Request::Request() : method(Method::GET), curlHandle(nullptr), list(nullptr), co
 
     //set default method
     curl_easy_setopt(curlHandle.get(), CURLOPT_HTTPGET, 1L);
+    // Never let libcurl time DNS out with SIGALRM, unsafe in multithreaded programs
+    curl_easy_setopt(curlHandle.get(), CURLOPT_NOSIGNAL, 1L);
 }
 
 Request::Request(Request&& other) noexcept
-   :method(other.method),
+   :pipeline(other.pipeline),
+    method(other.method),
     curlHandle(std::move(other.curlHandle)),
     list(std::move(other.list)),
     url(std::move(other.url)),
@@ -27,7 +49,48 @@ Request::Request(Request&& other) noexcept
     body(std::move(other.body)),
     cookieFile(std::move(other.cookieFile)),
     cookieJar(std::move(other.cookieJar)),
-    mime(std::move(other.mime)){
+    mime(std::move(other.mime)),
+    downloadFilePath(std::move(other.downloadFilePath)),
+    progressCallback(std::move(other.progressCallback)),
+    httpVersion(other.httpVersion),
+    tokenProvider(std::move(other.tokenProvider)),
+    proxyPool(std::move(other.proxyPool)),
+    resolverPool(std::move(other.resolverPool)),
+    dnsCache(std::move(other.dnsCache)),
+    socketOptions(std::move(other.socketOptions)),
+    sourceAddressPool(std::move(other.sourceAddressPool)),
+    sourceHost(std::move(other.sourceHost)),
+    sourceIndex(other.sourceIndex),
+    inFlight(std::move(other.inFlight)),
+    tracking(other.tracking),
+    resolveList(std::move(other.resolveList)),
+    timeoutSeconds(other.timeoutSeconds),
+    connectTimeoutSeconds(other.connectTimeoutSeconds),
+    mockResponse(std::move(other.mockResponse)),
+    recorder(std::move(other.recorder)),
+    slowRequestLog(std::move(other.slowRequestLog)),
+    attemptHistory(std::move(other.attemptHistory)),
+    costAccounting(other.costAccounting),
+    costLedger(std::move(other.costLedger)),
+    costKey(std::move(other.costKey)),
+    latencyTracker(std::move(other.latencyTracker)),
+    effectiveUrl(std::move(other.effectiveUrl)),
+    tokenHeader(std::move(other.tokenHeader)),
+    staticHeaders(other.staticHeaders),
+    interceptors(std::move(other.interceptors)),
+    receiveBuffers(std::move(other.receiveBuffers)),
+    receiveOverflow(other.receiveOverflow),
+    receiveResult(other.receiveResult),
+    bulkDownload(other.bulkDownload),
+    proxied(other.proxied),
+    downloadPath(other.downloadPath),
+    uploadFilePath(std::move(other.uploadFilePath)),
+    uploadZeroCopy(other.uploadZeroCopy),
+    uploadPath(other.uploadPath),
+    persistent(other.persistent),
+    usesAuth(other.usesAuth),
+    authStateCached(other.authStateCached),
+    authStats(other.authStats){
 }
 
 Request& Request::operator=(Request&& other) noexcept {
@@ -45,6 +108,48 @@ Request& Request::operator=(Request&& other) noexcept {
         body = std::move(other.body);
         cookieFile = std::move(other.cookieFile);
         cookieJar = std::move(other.cookieJar);
+        downloadFilePath = std::move(other.downloadFilePath);
+        progressCallback = std::move(other.progressCallback);
+        httpVersion = other.httpVersion;
+        tokenProvider = std::move(other.tokenProvider);
+        proxyPool = std::move(other.proxyPool);
+        resolverPool = std::move(other.resolverPool);
+        dnsCache = std::move(other.dnsCache);
+        socketOptions = std::move(other.socketOptions);
+        sourceAddressPool = std::move(other.sourceAddressPool);
+        sourceHost = std::move(other.sourceHost);
+        sourceIndex = other.sourceIndex;
+        inFlight = std::move(other.inFlight);
+        tracking = other.tracking;
+        resolveList = std::move(other.resolveList);
+        timeoutSeconds = other.timeoutSeconds;
+        connectTimeoutSeconds = other.connectTimeoutSeconds;
+        mockResponse = std::move(other.mockResponse);
+        recorder = std::move(other.recorder);
+        slowRequestLog = std::move(other.slowRequestLog);
+        attemptHistory = std::move(other.attemptHistory);
+        costAccounting = other.costAccounting;
+        costLedger = std::move(other.costLedger);
+        costKey = std::move(other.costKey);
+        latencyTracker = std::move(other.latencyTracker);
+        effectiveUrl = std::move(other.effectiveUrl);
+        tokenHeader = std::move(other.tokenHeader);
+        staticHeaders = other.staticHeaders;
+        interceptors = std::move(other.interceptors);
+        receiveBuffers = std::move(other.receiveBuffers);
+        receiveOverflow = other.receiveOverflow;
+        receiveResult = other.receiveResult;
+        bulkDownload = other.bulkDownload;
+        proxied = other.proxied;
+        downloadPath = other.downloadPath;
+        uploadFilePath = std::move(other.uploadFilePath);
+        uploadZeroCopy = other.uploadZeroCopy;
+        uploadPath = other.uploadPath;
+        persistent = other.persistent;
+        usesAuth = other.usesAuth;
+        authStateCached = other.authStateCached;
+        authStats = other.authStats;
+        pipeline = other.pipeline;
     }
     return *this;
 }
@@ -96,16 +201,16 @@ Request& Request::setURL(const std::string& URL) {
 }
 
 Request& Request::addArg(const std::string& key, const std::string& value) {
-    char* escapedKey = curl_easy_escape(curlHandle.get(), key.c_str(), 0);
-    char* escapedValue = curl_easy_escape(curlHandle.get(), value.c_str(), 0);
-
-    if(escapedKey && escapedValue){
-        std::string arg = std::string(escapedKey) + "=" + escapedValue;
-        args.append(args.empty() ? "" : "&").append(arg);
-    }
+    // Encode straight into args: no temporary strings once args has grown
+    if (!args.empty()) args.push_back('&');
+    detail::appendUrlEncoded(args, key);
+    args.push_back('=');
+    detail::appendUrlEncoded(args, value);
+    return *this;
+}
 
-    if(escapedKey) curl_free(escapedKey);
-    if(escapedValue) curl_free(escapedValue);
+Request& Request::clearArgs() {
+    args.clear();
     return *this;
 }
 
@@ -130,6 +235,33 @@ Request& Request::downloadToFile(const std::string& path) {
     return *this;
 }
 
+Request& Request::uploadFile(const std::string& path, bool zeroCopy) {
+    setMethod(Method::PUT);
+    uploadFilePath = path;
+    uploadZeroCopy = zeroCopy;
+    return *this;
+}
+
+Request& Request::setBulkDownload(bool enabled) {
+    bulkDownload = enabled;
+    return *this;
+}
+
+Request& Request::receiveInto(std::byte* buffer, size_t size, OverflowPolicy overflow) {
+    return receiveInto(std::vector<BufferRef>{BufferRef{buffer, size}}, overflow);
+}
+
+Request& Request::receiveInto(std::vector<BufferRef> buffers, OverflowPolicy overflow) {
+    for (const auto& buffer : buffers) {
+        if (!buffer.data && buffer.size) {
+            throw LogicException("receiveInto() buffer is null");
+        }
+    }
+    receiveBuffers = std::move(buffers);
+    receiveOverflow = overflow;
+    return *this;
+}
+
 Request& Request::setBody(const std::string& body) {
     this->body = body;
     if (method == Method::POST || method == Method::PUT || method == Method::PATCH) {
@@ -139,30 +271,221 @@ Request& Request::setBody(const std::string& body) {
 }
 
 Response Request::send(unsigned attempts) {
+    Response response;
+    send(response, attempts);
+    return response;
+}
+
+void Request::send(Response& response, unsigned attempts) {
+    if (pipeline.custom) {
+        throw LogicException("A BasicRequest must be sent through its own send()");
+    }
+    execute(response, attempts);
+}
+
+void Request::execute(Response& response, unsigned attempts) {
     if (attempts == 0) {
         throw LogicException("Number of attempts must be greater than zero");
     }
 
     const unsigned baseDelayMs = 1000; // initial delay of 1 second
+    const auto sendStart = std::chrono::steady_clock::now();
+    std::int64_t sendStartedAtUs = 0;
+    if (slowRequestLog) {
+        attemptHistory.clear();
+        sendStartedAtUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    detail::UsageMark usageStart;
+    if (costAccounting) {
+        usageStart = detail::UsageMark::now();
+    }
 
-    Response response;
-    FilePtr fileOut(nullptr);
-    std::ostringstream responseStream;
+    // By index: an interceptor may add another one
+    for (size_t i = 0; i < interceptors.size(); ++i) {
+        interceptors[i]->onRequest(*this);
+    }
 
+    FilePtr fileOut(nullptr);
+    struct UploadGuard {
+        Request& request;
+        ~UploadGuard() { request.closeUpload(); }
+    } uploadGuard{*this};
+    detail::HeaderContext headerContext{&response.headers, &headerKeyScratch, &spareHeaderValues};
+    headerContext.store = pipeline.headerStore;
+
+    updateTokenHeader();
+    // User headers, then the token, then the shared static set (never modified)
+    detail::SlistChain tokenAndStatic(tokenHeader.get(), const_cast<curl_slist*>(staticHeaders));
+    detail::SlistChain headers(list.get(), tokenAndStatic.get());
+    curl_easy_setopt(curlHandle.get(), CURLOPT_HTTPHEADER, headers.get());
         
-    prepareCurlOptions(response, fileOut, responseStream);
+    prepareCurlOptions(headerContext, fileOut, response.body);
+    if (!interceptors.empty()) {
+        interception.inner = callbacks;
+        interception.response = &response;
+        interception.headerContext = &headerContext;
+        callbacks.write = interceptWrite;
+        callbacks.writeData = this;
+        callbacks.header = interceptHeader;
+        callbacks.headerData = this;
+        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEFUNCTION, callbacks.write);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEDATA, callbacks.writeData);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERFUNCTION, callbacks.header);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERDATA, callbacks.headerData);
+    }
     updateURL();
     setCurlHttpVersion();
 
+#ifdef CURLING_USDT
+    const std::uint64_t probeId = detail::nextProbeId.fetch_add(1, std::memory_order_relaxed) + 1;
+    struct ProbeScope {
+        Request& request;
+        std::uint64_t previous;
+        ~ProbeScope() {
+            detail::activeProbeId = previous;
+            request.probes = PhaseProbes{};
+#if LIBCURL_VERSION_NUM >= 0x075000
+            // The handle outlives this send(), it must not call back into a moved Request
+            curl_easy_setopt(request.curlHandle.get(), CURLOPT_PREREQFUNCTION, nullptr);
+#endif
+        }
+    } probeScope{*this, detail::activeProbeId};
+    detail::activeProbeId = probeId;
+    CURLcode lastResult = CURLE_OK;
+    if (!mockResponse) {
+        // Phase probes fire as libcurl gets there: connect/TLS before the request goes out, first byte on the status line
+        probes.id = probeId;
+        probes.header = callbacks.header;
+        probes.headerData = callbacks.headerData;
+        curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERFUNCTION, probeHeader);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERDATA, this);
+#if LIBCURL_VERSION_NUM >= 0x075000
+        curl_easy_setopt(curlHandle.get(), CURLOPT_PREREQFUNCTION, probePrereq);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_PREREQDATA, this);
+#endif
+    }
+#endif
+    CURLING_PROBE3(request__start, probeId, effectiveUrl.c_str(), attempts);
+
+    struct InFlightScope {
+        Request& request;
+        ~InFlightScope() { request.inFlight = InFlightRegistry::Registration(); }
+    } inFlightScope{*this};
+    if (auto registry = inFlightRegistry()) {
+        inFlight = InFlightRegistry::enter(registry, effectiveUrl);
+        if (inFlight) {
+            tracking.inner = callbacks.progress;
+            tracking.innerData = callbacks.progressData;
+            callbacks.progress = trackProgress;
+            callbacks.progressData = this;
+            curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFOFUNCTION, callbacks.progress);
+            curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFODATA, callbacks.progressData);
+            curl_easy_setopt(curlHandle.get(), CURLOPT_NOPROGRESS, 0L);
+        }
+    }
+
     for (unsigned attempt = 1; attempt <= attempts; ++attempt) {
-        
+        if (inFlight) {
+            inFlight.setAttempt(attempt);
+            inFlight.update(InFlightRegistry::Phase::Resolving, 0, 0, -1);
+        }
         try{
-            // Perform request
-            CURLcode res = curl_easy_perform(curlHandle.get());
+            // Start each attempt from an empty response, keeping its memory
+            response.httpCode = 0;
+            if (pipeline.custom) {
+                pipeline.begin(pipeline.beginData);
+            } else {
+                response.body.clear();
+                detail::recycleHeaders(response.headers, spareHeaderValues);
+            }
+            headerContext.authChallenges = 0;
+            headerContext.status = 0;
+            receiveCursor.index = 0;
+            receiveCursor.offset = 0;
+            receiveResult = ReceiveResult{};
+            bulk.written = 0;
+            bulk.decided = false;
+            bulk.spliced = false;
+            bulk.error = 0;
+            bulk.startedAt = std::chrono::steady_clock::now();
+            upload.offset = 0;
+            upload.decided = false;
+            upload.sent = false;
+            upload.error = 0;
+            probes.connected = false;
+            probes.firstByte = false;
+
+            // Lease a proxy per attempt, so a retry moves on to another one
+            ProxyPool::Lease proxyLease;
+            auto attemptStart = std::chrono::steady_clock::now();
+            auto startedAtUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            if (proxyPool) {
+                proxyLease = proxyPool->acquire();
+                curl_easy_setopt(curlHandle.get(), CURLOPT_PROXY, proxyLease.proxy().c_str());
+            }
+
+            // Lease a source address per attempt, sticking to the last one that worked for the same host
+            SourceAddressPool::Lease addressLease;
+            struct SourceLeaseScope {
+                Request& request;
+                ~SourceLeaseScope() { request.sourceLease = nullptr; }
+            } sourceLeaseScope{*this};
+            if (sourceAddressPool) {
+                std::string host, port;
+                urlHostPort(host, port);
+                // A retry picks afresh, the preferred address may be the one that failed
+                addressLease = sourceAddressPool->acquire(host, attempt == 1 && host == sourceHost ? sourceIndex : -1);
+                sourceHost = host;
+                sourceIndex = static_cast<long>(addressLease.index());
+                sourceLease = &addressLease;
+                curl_easy_setopt(curlHandle.get(), CURLOPT_INTERFACE, addressLease.address().c_str());
+            }
+
+            // Perform request, HTTP status code is set regardless of result
+            CURLcode res = resolveHost();
+            if (res == CURLE_OK) res = perform(response.httpCode);
+
+            if (proxyLease) {
+                proxyLease.complete(res == CURLE_OK, std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                         std::chrono::steady_clock::now() - attemptStart));
+            }
+
+#ifdef CURLING_USDT
+            lastResult = res;
+#if LIBCURL_VERSION_NUM < 0x075000
+            // No CURLOPT_PREREQFUNCTION: the connect probes fire once the attempt is over
+            if (!mockResponse) fireConnectProbes();
+#endif
+#endif
+
+            if (slowRequestLog) {
+                attemptHistory.push_back(SlowRequestLog::Attempt{res, response.httpCode,
+                    std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - attemptStart)});
+            }
 
-            // Get HTTP status code regardless of result
-            curl_easy_getinfo(curlHandle.get(), CURLINFO_RESPONSE_CODE, &(response.httpCode));
+            if (pipeline.complete || !interceptors.empty()) {
+                Completion completion;
+                completion.result = res;
+                completion.httpCode = response.httpCode;
+                completion.attempt = attempt;
+                completion.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - attemptStart);
+                if (pipeline.complete) pipeline.complete(pipeline.completeData, completion);
+                for (const auto& interceptor : interceptors) interceptor->onComplete(completion);
+            }
 
+            if (res == CURLE_WRITE_ERROR && receiveResult.overflow > 0 && receiveOverflow == OverflowPolicy::Error) {
+                throw RequestException("Response body does not fit the receive buffers (" +
+                                       std::to_string(receiveResult.size) + " bytes received)");
+            }
+            if (upload.error) {
+                throw RequestException(std::string("File upload failed: ") + std::strerror(upload.error));
+            }
+            if (bulk.error) {
+                throw RequestException(std::string("Bulk download failed: ") + std::strerror(bulk.error));
+            }
             if (res != CURLE_OK) {
                 throw RequestException(
                     std::string("Curl perform failed on attempt ") + std::to_string(attempt) +
@@ -170,17 +493,69 @@ Response Request::send(unsigned attempts) {
                 );
             }
 
-            // Store response body if not downloading to file
-            if (downloadFilePath.empty()) {
-                response.body = responseStream.str();
+            downloadPath = bulk.spliced ? TransferPath::Splice : TransferPath::Copy;
+            uploadPath = upload.sent ? TransferPath::Sendfile : TransferPath::Mmap;
+            detail::dropEmptyHeaders(response.headers);
+
+            if (recorder) {
+                record(response, startedAtUs, headers.get());
+            }
+
+            if (usesAuth) {
+                if (headerContext.authChallenges > 0) {
+                    ++authStats.challenges;
+                    authStateCached = true;
+                } else if (authStateCached) {
+                    ++authStats.challengesAvoided;
+                }
+            }
+
+            if (slowRequestLog) {
+                reportSlow(sendStartedAtUs, sendStart);
+            }
+            if (costAccounting) {
+                accountCost(response, usageStart);
+            }
+            if (latencyTracker && !mockResponse) {
+                std::string host, port;
+                if (urlHostPort(host, port)) {
+                    long connects = 0;
+                    curl_easy_getinfo(curlHandle.get(), CURLINFO_NUM_CONNECTS, &connects);
+                    latencyTracker->record(host + ":" + port, phaseTimings(), connects > 0);
+                }
+            }
+#ifdef CURLING_USDT
+            {
+                curl_off_t received = 0;
+                curl_easy_getinfo(curlHandle.get(), CURLINFO_SIZE_DOWNLOAD_T, &received);
+                CURLING_PROBE4(request__done, probeId, response.httpCode, static_cast<int>(res), received);
             }
+#endif
 
-            reset(); // Reset for reuse
-            return response;
+            if (!persistent) {
+                // Unchain first, reset() frees the request's own list
+                headers.unlink();
+                tokenAndStatic.unlink();
+                reset(); // Reset for reuse
+            }
+            return;
 
         } catch (const RequestException& e) {
+            sourceHost.clear(); // no affinity to an address whose attempt failed
+            sourceIndex = -1;
             if (attempt == attempts) {
-                reset();
+                if (slowRequestLog) {
+                    reportSlow(sendStartedAtUs, sendStart);
+                }
+                if (costAccounting) {
+                    accountCost(response, usageStart);
+                }
+                CURLING_PROBE4(request__done, probeId, response.httpCode, static_cast<int>(lastResult), curl_off_t(0));
+                if (!persistent) {
+                    headers.unlink();
+                    tokenAndStatic.unlink();
+                    reset();
+                }
                 throw; // rethrow if final attempt fails
             }
 
@@ -190,8 +565,16 @@ Response Request::send(unsigned attempts) {
             // Optional: Add jitter (randomize slightly to avoid thundering herd)
             // delayMs += rand() % 250;
 
-            std::cerr << "Retry attempt " << attempt << " failed. Retrying in " << delayMs << "ms...\n";
+            std::string message = "Retry attempt " + std::to_string(attempt) + " failed. Retrying in " +
+                                  std::to_string(delayMs) + "ms...";
+            if (pipeline.log) {
+                pipeline.log(message);
+            } else {
+                log(message);
+            }
 
+            if (inFlight) inFlight.setPhase(InFlightRegistry::Phase::Backoff);
+            CURLING_PROBE3(retry__scheduled, probeId, attempt, delayMs);
             waitMs(delayMs);
         }
     }
@@ -200,26 +583,86 @@ Response Request::send(unsigned attempts) {
     throw LogicException("Retry logic terminated unexpectedly");
 }
 
+void Request::updateTokenHeader() {
+    // Read the token at dispatch time, so a background refresh is picked up
+    if (tokenProvider) {
+        std::string header = "Authorization: Bearer " + tokenProvider->token();
+        tokenHeader.reset(curl_slist_append(nullptr, header.c_str()));
+        if (!tokenHeader) {
+            throw HeaderException("Failed to append header to curl_slist");
+        }
+    }
+}
+
+ResponseStream Request::openStream(size_t bufferSize) {
+    if (!downloadFilePath.empty() || !receiveBuffers.empty()) {
+        throw LogicException("openStream() cannot be combined with downloadToFile() or receiveInto()");
+    }
+    if (mockResponse) {
+        throw LogicException("openStream() needs a network transfer, not a mock response");
+    }
+    if (bufferSize == 0) {
+        throw LogicException("Stream buffer size must be greater than zero");
+    }
+    return ResponseStream(*this, bufferSize);
+}
+
 void Request::reset() {
-    // Create and immediately assign new handle
-    curlHandle.reset(curl_easy_init());
-    if (!curlHandle) {
-        throw InitializationException("Curl re-initialization failed");
+    if (persistent) {
+        // Keep the handle: connections and DNS cache survive, options and auth state don't
+        curl_easy_reset(curlHandle.get());
+    } else {
+        // Create and immediately assign new handle
+        curlHandle.reset(curl_easy_init());
+        if (!curlHandle) {
+            throw InitializationException("Curl re-initialization failed");
+        }
     }
+    usesAuth = false;
+    authStateCached = false;
+    effectiveUrl.clear(); // the handle no longer has a URL
 
     mime.reset();
     list.reset();
+    tokenHeader.reset();
+    staticHeaders = nullptr;
+    interceptors.clear();
+    receiveBuffers.clear();
+    receiveOverflow = OverflowPolicy::Error;
+    bulkDownload = false;
+    proxied = false;
+    uploadFilePath.clear();
+    uploadZeroCopy = true;
 
     args.clear();
     url.clear();
     body.clear();
     downloadFilePath.clear();
     progressCallback = nullptr;
+    tokenProvider.reset();
+    proxyPool.reset();
+    resolverPool.reset();
+    dnsCache.reset();
+    socketOptions.reset();
+    sourceAddressPool.reset();
+    sourceHost.clear();
+    sourceIndex = -1;
+    resolveList.reset();
+    timeoutSeconds = 0;
+    connectTimeoutSeconds = 0;
+    mockResponse.reset();
+    recorder.reset();
+    slowRequestLog.reset();
+    costAccounting = false;
+    costLedger.reset();
+    costKey.clear();
+    latencyTracker.reset();
     cookieFile.clear();
     cookieJar.clear();
 
     method = Method::GET;
     curl_easy_setopt(curlHandle.get(), CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curlHandle.get(), CURLOPT_NOSIGNAL, 1L);
 
     httpVersion = HttpVersion::DEFAULT;
     curl_easy_setopt(curlHandle.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_NONE);
@@ -228,25 +671,68 @@ void Request::reset() {
 void Request::clean() noexcept {
     mime.reset();
     list.reset();
+    tokenHeader.reset();
     curlHandle.reset();
+    resolveList.reset();
 }
 
 void Request::updateURL() {
-    std::string s = args.empty() ? url : url + "?" + args;
-    curl_easy_setopt(curlHandle.get(), CURLOPT_URL, s.c_str());
+    urlScratch.assign(url);
+    if (!args.empty()) {
+        urlScratch.append(1, '?').append(args);
+    }
+    // libcurl copies the URL on each setopt, skip it when a persistent request resends the same one
+    if (urlScratch != effectiveUrl) {
+        effectiveUrl.swap(urlScratch);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_URL, effectiveUrl.c_str());
+    }
 }
 
 Request& Request::setTimeout(long seconds){
     curl_easy_setopt(curlHandle.get(), CURLOPT_TIMEOUT, seconds);
+    timeoutSeconds = seconds;
     return *this;
 }
 
 Request& Request::setProxy(const std::string& url){
     curl_easy_setopt(curlHandle.get(), CURLOPT_PROXY, url.c_str());
+    proxied = !url.empty();
+    return *this;
+}
+
+Request& Request::setProxyPool(std::shared_ptr<ProxyPool> pool){
+    if (pool) {
+        // Keep an open connection to each proxy of the pool
+        long maxConnects = std::max<long>(5, static_cast<long>(pool->size()));
+        curl_easy_setopt(curlHandle.get(), CURLOPT_MAXCONNECTS, maxConnects);
+    }
+    proxyPool = std::move(pool);
+    return *this;
+}
+
+Request& Request::setResolverPool(std::shared_ptr<ResolverPool> pool){
+    resolverPool = std::move(pool);
+    return *this;
+}
+
+Request& Request::setDnsCache(std::shared_ptr<DnsCache> cache){
+    dnsCache = std::move(cache);
+    return *this;
+}
+
+Request& Request::setSocketOptions(const SocketOptions& options){
+    curl_easy_setopt(curlHandle.get(), CURLOPT_INTERFACE, options.interface.empty() ? nullptr : options.interface.c_str());
+    socketOptions = options;
+    return *this;
+}
+
+Request& Request::setSourceAddressPool(std::shared_ptr<SourceAddressPool> pool){
+    sourceAddressPool = std::move(pool);
     return *this;
 }
 
 Request& Request::setProxyAuth(const std::string& username, const std::string & password){
+    usesAuth = true;
     curl_easy_setopt(curlHandle.get(), CURLOPT_PROXYUSERPWD, (username+":"+password).c_str());
     return *this;
 }
@@ -258,6 +744,7 @@ Request& Request::setProxyAuthMethod(AuthMethod method){
 }
 
 Request& Request::setHttpAuth(const std::string& username, const std::string & password){
+    usesAuth = true;
     curl_easy_setopt(curlHandle.get(), CURLOPT_USERPWD, (username+":"+password).c_str());
     return *this;
 }
@@ -270,6 +757,12 @@ Request& Request::setHttpAuthMethod(AuthMethod method){
 
 Request& Request::setConnectTimeout(long seconds){
     curl_easy_setopt(curlHandle.get(), CURLOPT_CONNECTTIMEOUT, seconds);
+    connectTimeoutSeconds = seconds;
+    return *this;
+}
+
+Request& Request::setStaticHeaders(const curl_slist* headers){
+    staticHeaders = headers;
     return *this;
 }
 
@@ -279,6 +772,16 @@ Request& Request::setAuthToken(const std::string& token){
     return *this;
 }
 
+Request& Request::setPersistent(bool enabled){
+    persistent = enabled;
+    return *this;
+}
+
+Request& Request::setTokenProvider(std::shared_ptr<TokenProvider> provider){
+    tokenProvider = std::move(provider);
+    return *this;
+}
+
 Request& Request::setFollowRedirects(bool follow){
     curl_easy_setopt(curlHandle.get(), CURLOPT_FOLLOWLOCATION, follow ? 1L : 0L);
     return *this;
@@ -332,18 +835,55 @@ Request& Request::enableVerbose(bool enabled){
 }
 
 
-Request& Request::setHttpVersion(HttpVersion version) {
-    
-    curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+Request& Request::setMockResponse(std::shared_ptr<const MockResponse> mock){
+    mockResponse = std::move(mock);
+    return *this;
+}
+
+Request& Request::setRecorder(std::shared_ptr<TrafficRecorder> rec){
+    recorder = std::move(rec);
+    return *this;
+}
+
+Request& Request::setSlowRequestLog(std::shared_ptr<SlowRequestLog> log){
+    slowRequestLog = std::move(log);
+    return *this;
+}
+
+Request& Request::setCostAccounting(bool enable){
+    costAccounting = enable;
+    return *this;
+}
+
+Request& Request::setCostLedger(std::shared_ptr<CostLedger> ledger, std::string key){
+    costLedger = std::move(ledger);
+    costKey = std::move(key);
+    if (costLedger) costAccounting = true;
+    return *this;
+}
+
+Request& Request::setLatencyTracker(std::shared_ptr<LatencyTracker> tracker){
+    latencyTracker = std::move(tracker);
+    return *this;
+}
 
+Request& Request::addInterceptor(std::shared_ptr<Interceptor> interceptor){
+    if (!interceptor) {
+        throw LogicException("Interceptor must not be null");
+    }
+    interceptors.push_back(std::move(interceptor));
+    return *this;
+}
+
+Request& Request::setHttpVersion(HttpVersion version) {
     switch (version) {
         case HttpVersion::HTTP_2:
-            if (!(info->features & CURL_VERSION_HTTP2)) {
+            if (!capabilities().http2) {
                 throw LogicException("HTTP/2 is not supported by the current libcurl build.");
             }
             break;
         case HttpVersion::HTTP_3:
-            if (!(info->features & CURL_VERSION_HTTP3)) {
+            if (!capabilities().http3) {
                 throw LogicException("HTTP/3 is not supported by the current libcurl build.");
             }
             break;
@@ -355,11 +895,20 @@ Request& Request::setHttpVersion(HttpVersion version) {
     return *this;
 }
 
-void Request::prepareCurlOptions(Response& response, FilePtr& fileOut, std::ostringstream& responseStream) {
-    // Set progress callback if defined
-    if (progressCallback) {
-        curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFOFUNCTION, detail::ProgressCallbackBridge);
-        curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFODATA, this);
+void Request::prepareCurlOptions(detail::HeaderContext& headerContext, FilePtr& fileOut, std::string& responseBody) {
+    // Set progress callback if defined, a pipeline hook takes precedence
+    callbacks.progress = nullptr;
+    callbacks.progressData = nullptr;
+    if (pipeline.progress) {
+        callbacks.progress = pipeline.progress;
+        callbacks.progressData = pipeline.progressData;
+    } else if (progressCallback) {
+        callbacks.progress = detail::ProgressCallbackBridge;
+        callbacks.progressData = this;
+    }
+    if (callbacks.progress) {
+        curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFOFUNCTION, callbacks.progress);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_XFERINFODATA, callbacks.progressData);
         curl_easy_setopt(curlHandle.get(), CURLOPT_NOPROGRESS, 0L);
     } else {
         curl_easy_setopt(curlHandle.get(), CURLOPT_NOPROGRESS, 1L);
@@ -371,16 +920,570 @@ void Request::prepareCurlOptions(Response& response, FilePtr& fileOut, std::ostr
         if (!fileOut) {
             throw RequestException("Failed to open file for writing: " + downloadFilePath);
         }
-        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEFUNCTION, nullptr);
-        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEDATA, fileOut.get());
+        if (bulkDownload) {
+            bulk.file = fileOut.get();
+            bulk.headers = headerContext.headers;
+            callbacks.write = bulkWrite;
+            callbacks.writeData = this;
+            // One socket read per write callback, nothing is left behind in libcurl's buffer
+            curl_easy_setopt(curlHandle.get(), CURLOPT_BUFFERSIZE, static_cast<long>(CURL_MAX_WRITE_SIZE));
+        } else {
+            callbacks.write = detail::FileWriteCallback;
+            callbacks.writeData = fileOut.get();
+        }
+    } else if (!receiveBuffers.empty()) {
+        receiveCursor.spill = &responseBody;
+        callbacks.write = receiveWrite;
+        callbacks.writeData = this;
+    } else if (pipeline.custom) {
+        callbacks.write = pipeline.write;
+        callbacks.writeData = pipeline.writeData;
     } else {
-        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEFUNCTION, detail::WriteCallback);
-        curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEDATA, &responseStream);
+        callbacks.write = detail::WriteCallback;
+        callbacks.writeData = &responseBody;
+    }
+    curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEFUNCTION, callbacks.write);
+    curl_easy_setopt(curlHandle.get(), CURLOPT_WRITEDATA, callbacks.writeData);
+
+    if (!uploadFilePath.empty()) {
+        openUpload();
+    }
+
+    // One socket callback applies the socket options and tracks sockets for splice/sendfile
+    if (socketOptions || sourceAddressPool || (bulkDownload && !downloadFilePath.empty()) || (!uploadFilePath.empty() && uploadZeroCopy)) {
+        curl_easy_setopt(curlHandle.get(), CURLOPT_SOCKOPTFUNCTION, configureSocket);
+        curl_easy_setopt(curlHandle.get(), CURLOPT_SOCKOPTDATA, this);
     }
 
     // Set header callback
-    curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERFUNCTION, detail::HeaderCallback);
-    curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERDATA, &(response.headers));
+    callbacks.header = pipeline.custom && pipeline.header ? pipeline.header : detail::HeaderCallback;
+    callbacks.headerData = &headerContext;
+    curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERFUNCTION, callbacks.header);
+    curl_easy_setopt(curlHandle.get(), CURLOPT_HEADERDATA, callbacks.headerData);
+}
+
+CURLcode Request::perform(long& httpCode) {
+    if (mockResponse) {
+        return performMock(httpCode);
+    }
+    CURLcode res = curl_easy_perform(curlHandle.get());
+    curl_easy_getinfo(curlHandle.get(), CURLINFO_RESPONSE_CODE, &httpCode);
+    if (res == CURLE_WRITE_ERROR && bulk.spliced) {
+        res = CURLE_OK; // the transfer was stopped once splice had moved the whole body
+    }
+    // A splice that ran out of time or was cancelled fails the way libcurl's own transfer would
+    if (res == CURLE_WRITE_ERROR && (bulk.error == ETIMEDOUT || bulk.error == ECANCELED)) {
+        res = bulk.error == ETIMEDOUT ? CURLE_OPERATION_TIMEDOUT : CURLE_ABORTED_BY_CALLBACK;
+        bulk.error = 0;
+    }
+    if (res == CURLE_ABORTED_BY_CALLBACK && (upload.error == ETIMEDOUT || upload.error == ECANCELED)) {
+        res = upload.error == ETIMEDOUT ? CURLE_OPERATION_TIMEDOUT : CURLE_ABORTED_BY_CALLBACK;
+        upload.error = 0;
+    }
+    return res;
+}
+
+bool Request::urlHostPort(std::string& host, std::string& port) const {
+    std::unique_ptr<CURLU, decltype(&curl_url_cleanup)> parsed(curl_url(), curl_url_cleanup);
+    if (!parsed || curl_url_set(parsed.get(), CURLUPART_URL, effectiveUrl.c_str(), CURLU_GUESS_SCHEME) != CURLUE_OK) {
+        return false;
+    }
+    char* hostPart = nullptr;
+    char* portPart = nullptr;
+    curl_url_get(parsed.get(), CURLUPART_HOST, &hostPart, 0);
+    curl_url_get(parsed.get(), CURLUPART_PORT, &portPart, CURLU_DEFAULT_PORT);
+    host = hostPart ? hostPart : "";
+    port = portPart ? portPart : "";
+    curl_free(hostPart);
+    curl_free(portPart);
+    return !host.empty() && !port.empty();
+}
+
+size_t Request::probeHeader(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto* request = static_cast<Request*>(userdata);
+    auto& probes = request->probes;
+    if (!probes.firstByte) {
+        probes.firstByte = true;
+        curl_off_t startTransfer = 0;
+        curl_easy_getinfo(request->curlHandle.get(), CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+        CURLING_PROBE2(first__byte, probes.id, startTransfer);
+    }
+    return probes.header(buffer, size, nitems, probes.headerData);
+}
+
+int Request::probePrereq(void* clientp, char*, char*, int, int) {
+    static_cast<Request*>(clientp)->fireConnectProbes();
+    return 0; // CURL_PREREQFUNC_OK
+}
+
+void Request::fireConnectProbes() {
+    if (probes.connected) return;
+    probes.connected = true;
+    // libcurl's timings (us) since the attempt started
+    Exchange::Timings t = phaseTimings();
+    if (t.nameLookup) CURLING_PROBE2(dns__done, probes.id, t.nameLookup);
+    if (t.connect) CURLING_PROBE2(connect__done, probes.id, t.connect);
+    if (t.appConnect) CURLING_PROBE2(tls__done, probes.id, t.appConnect);
+}
+
+int Request::trackProgress(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    auto* request = static_cast<Request*>(clientp);
+    CURL* handle = request->curlHandle.get();
+    curl_off_t nameLookup = 0, connect = 0, appConnect = 0, preTransfer = 0, startTransfer = 0;
+    curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &nameLookup);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &appConnect);
+    curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &preTransfer);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &startTransfer);
+    curl_off_t connectionId = -1;
+#if LIBCURL_VERSION_NUM >= 0x080200
+    curl_easy_getinfo(handle, CURLINFO_CONN_ID, &connectionId);
+#else
+    // No connection ids before libcurl 8.2, the local port tells connections apart
+    long localPort = 0;
+    if (curl_easy_getinfo(handle, CURLINFO_LOCAL_PORT, &localPort) == CURLE_OK && localPort > 0) connectionId = localPort;
+#endif
+
+    using Phase = InFlightRegistry::Phase;
+    Phase phase = Phase::Resolving;
+    if (startTransfer > 0 || dlnow > 0) phase = Phase::Receiving;
+    else if (preTransfer > 0) phase = ulnow < ultotal ? Phase::Sending : Phase::Waiting;
+    else if (connect > 0) phase = appConnect > 0 ? Phase::Sending : Phase::TlsHandshake;
+    else if (nameLookup > 0) phase = Phase::Connecting;
+    request->inFlight.update(phase, dlnow, ulnow, connectionId);
+
+    const auto& tracking = request->tracking;
+    return tracking.inner ? tracking.inner(tracking.innerData, dltotal, dlnow, ultotal, ulnow) : 0;
+}
+
+CURLcode Request::resolveHost() {
+    if (mockResponse || proxied || proxyPool) return CURLE_OK;
+    std::shared_ptr<ResolverPool> pool = resolverPool;
+    if (!pool && !dnsCache) {
+        if (capabilities().asyncDns) return CURLE_OK;
+        pool = ResolverPool::shared();
+    }
+
+    std::string host, port;
+    if (!urlHostPort(host, port)) {
+        return CURLE_OK; // libcurl reports the malformed URL
+    }
+
+    // Literal addresses need no lookup
+    in_addr v4;
+    if (host.front() == '[' || ::inet_pton(AF_INET, host.c_str(), &v4) == 1) {
+        return CURLE_OK;
+    }
+
+    long seconds = connectTimeoutSeconds > 0 ? connectTimeoutSeconds : timeoutSeconds;
+    if (seconds <= 0) seconds = 300; // libcurl's default connect timeout
+    auto addresses = dnsCache ? dnsCache->lookup(host, port) : pool->lookup(host, port).share();
+    if (addresses.wait_for(std::chrono::seconds(seconds)) != std::future_status::ready) {
+        return CURLE_OPERATION_TIMEDOUT;
+    }
+
+    std::string entry = host + ":" + port + ":";
+    try {
+        const auto& resolved = addresses.get();
+        for (size_t i = 0; i < resolved.size(); ++i) {
+            if (i) entry += ',';
+            entry += resolved[i];
+        }
+    } catch (const RequestException&) {
+        return CURLE_COULDNT_RESOLVE_HOST;
+    }
+    resolveList.reset(curl_slist_append(nullptr, entry.c_str()));
+    curl_easy_setopt(curlHandle.get(), CURLOPT_RESOLVE, resolveList.get());
+    return CURLE_OK;
+}
+
+CURLcode Request::performMock(long& httpCode) {
+    const MockResponse& mock = *mockResponse;
+    httpCode = 0;
+    if (mock.result != CURLE_OK) {
+        return mock.result;
+    }
+
+    // Same sequence libcurl produces: status line, header lines, blank line, body chunks
+    char line[64];
+    size_t len = static_cast<size_t>(std::snprintf(line, sizeof(line), "HTTP/1.1 %ld\r\n", mock.httpCode));
+    if (callbacks.header(line, 1, len, callbacks.headerData) != len) {
+        return CURLE_WRITE_ERROR;
+    }
+    for (const auto& header : mock.headers) {
+        if (callbacks.header(const_cast<char*>(header.data()), 1, header.size(), callbacks.headerData) != header.size()) {
+            return CURLE_WRITE_ERROR;
+        }
+    }
+    char blank[] = "\r\n";
+    if (callbacks.header(blank, 1, 2, callbacks.headerData) != 2) {
+        return CURLE_WRITE_ERROR;
+    }
+
+    const size_t total = mock.body.size();
+    const size_t chunk = mock.chunkSize ? mock.chunkSize : total;
+    for (size_t offset = 0; offset < total; offset += chunk) {
+        size_t n = std::min(chunk, total - offset);
+        if (callbacks.write(const_cast<char*>(mock.body.data()) + offset, 1, n, callbacks.writeData) != n) {
+            return CURLE_WRITE_ERROR;
+        }
+        if (callbacks.progress && callbacks.progress(callbacks.progressData, static_cast<curl_off_t>(total),
+                                                     static_cast<curl_off_t>(offset + n), 0, 0)) {
+            return CURLE_ABORTED_BY_CALLBACK;
+        }
+    }
+
+    httpCode = mock.httpCode;
+    return CURLE_OK;
+}
+
+size_t Request::interceptWrite(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* request = static_cast<Request*>(userp);
+    const size_t total = size * nmemb;
+    for (const auto& interceptor : request->interceptors) {
+        if (!interceptor->onChunk(data, total)) return 0;
+    }
+    const auto& inner = request->interception.inner;
+    return inner.write(data, size, nmemb, inner.writeData);
+}
+
+size_t Request::receiveWrite(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* request = static_cast<Request*>(userp);
+    auto& cursor = request->receiveCursor;
+    const auto& buffers = request->receiveBuffers;
+    const size_t total = size * nmemb;
+    CURLING_PROBE2(write__chunk, detail::activeProbeId, total);
+
+    size_t done = 0;
+    while (done < total && cursor.index < buffers.size()) {
+        const BufferRef& buffer = buffers[cursor.index];
+        size_t n = std::min(total - done, buffer.size - cursor.offset);
+        std::memcpy(buffer.data + cursor.offset, data + done, n);
+        done += n;
+        cursor.offset += n;
+        if (cursor.offset == buffer.size) {
+            ++cursor.index;
+            cursor.offset = 0;
+        }
+    }
+    request->receiveResult.size += done;
+
+    if (done < total) {
+        request->receiveResult.overflow += total - done;
+        switch (request->receiveOverflow) {
+            case OverflowPolicy::Error:    return 0; // aborts with CURLE_WRITE_ERROR
+            case OverflowPolicy::Truncate: break;
+            case OverflowPolicy::Spill:    cursor.spill->append(data + done, total - done); break;
+        }
+    }
+    return total;
+}
+
+size_t Request::bulkWrite(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* request = static_cast<Request*>(userp);
+    auto& bulk = request->bulk;
+    const size_t total = size * nmemb;
+    CURLING_PROBE2(write__chunk, detail::activeProbeId, total);
+    if (std::fwrite(data, 1, total, bulk.file) != total) return 0;
+    bulk.written += static_cast<curl_off_t>(total);
+    if (bulk.decided) return total;
+    bulk.decided = true;
+
+    CURL* handle = request->curlHandle.get();
+    curl_off_t length = -1;
+    if (!request->bulkEligible() ||
+        curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) != CURLE_OK ||
+        length <= bulk.written) {
+        return total;
+    }
+    curl_socket_t socket = request->findBulkSocket();
+    if (socket == CURL_SOCKET_BAD) return total;
+
+    // The first chunk was read along with the headers, the rest is still in the socket
+    if (std::fflush(bulk.file) != 0) return 0;
+    bulk.error = request->spliceToFile(socket, fileno(bulk.file), length);
+    if (bulk.error) return 0;
+    bulk.written = length;
+    bulk.spliced = true;
+    return 0; // stop libcurl, it must not read the socket any more
+}
+
+bool Request::bulkEligible() const {
+#ifdef __linux__
+    if (mockResponse || pipeline.custom || proxied || proxyPool || method != Method::GET) return false;
+
+    CURL* handle = curlHandle.get();
+    long code = 0;
+    long version = 0;
+    char* scheme = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &version);
+    curl_easy_getinfo(handle, CURLINFO_SCHEME, &scheme);
+    if (code != 200 || !scheme || strcasecmp(scheme, "http") != 0 ||
+        (version != CURL_HTTP_VERSION_1_0 && version != CURL_HTTP_VERSION_1_1)) {
+        return false;
+    }
+    // Checked over every header block seen, which errs on the side of the regular path
+    return bulk.headers && bulk.headers->count("transfer-encoding") == 0 &&
+           bulk.headers->count("content-encoding") == 0;
+#else
+    return false;
+#endif
+}
+
+int Request::configureSocket(void* clientp, curl_socket_t socket, curlsocktype purpose) {
+    auto* request = static_cast<Request*>(clientp);
+    if (purpose == CURLSOCKTYPE_IPCXN && request->socketOptions) {
+        const SocketOptions& options = *request->socketOptions;
+        bool failed = false;
+        auto apply = [&](int level, int name, int value, const char* label) {
+            if (::setsockopt(socket, level, name, &value, sizeof(value)) != 0) {
+                log(std::string("setsockopt(") + label + ") failed: " + std::strerror(errno));
+                failed = true;
+            }
+        };
+        if (options.receiveBuffer > 0) apply(SOL_SOCKET, SO_RCVBUF, options.receiveBuffer, "SO_RCVBUF");
+        if (options.sendBuffer > 0) apply(SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF");
+#ifdef SO_BUSY_POLL
+        if (options.busyPollMicros > 0) apply(SOL_SOCKET, SO_BUSY_POLL, options.busyPollMicros, "SO_BUSY_POLL");
+#endif
+        if (options.tos >= 0) {
+            sockaddr_storage address{};
+            socklen_t length = sizeof(address);
+            bool v6 = ::getsockname(socket, reinterpret_cast<sockaddr*>(&address), &length) == 0 &&
+                      address.ss_family == AF_INET6;
+            if (v6) apply(IPPROTO_IPV6, IPV6_TCLASS, options.tos, "IPV6_TCLASS");
+            else apply(IPPROTO_IP, IP_TOS, options.tos, "IP_TOS");
+        }
+        if (failed && options.strict) return CURL_SOCKOPT_ERROR;
+    }
+    if (purpose == CURLSOCKTYPE_IPCXN && request->sourceLease) {
+        request->sourceLease->connected();
+    }
+    if (purpose == CURLSOCKTYPE_IPCXN) {
+        auto& sockets = request->bulk.sockets;
+        sockets.erase(std::remove(sockets.begin(), sockets.end(), socket), sockets.end());
+        if (sockets.size() >= 16) sockets.erase(sockets.begin());
+        sockets.push_back(socket);
+    }
+    return CURL_SOCKOPT_OK;
+}
+
+curl_socket_t Request::findBulkSocket() const {
+    // CURLINFO_ACTIVESOCKET is only set once a transfer is done: match a tracked
+    // socket against the ports of the current connection instead
+    long localPort = 0;
+    long peerPort = 0;
+    curl_easy_getinfo(curlHandle.get(), CURLINFO_LOCAL_PORT, &localPort);
+    curl_easy_getinfo(curlHandle.get(), CURLINFO_PRIMARY_PORT, &peerPort);
+    auto portOf = [](const sockaddr_storage& address) -> long {
+        if (address.ss_family == AF_INET) return ntohs(reinterpret_cast<const sockaddr_in&>(address).sin_port);
+        if (address.ss_family == AF_INET6) return ntohs(reinterpret_cast<const sockaddr_in6&>(address).sin6_port);
+        return -1;
+    };
+    for (auto it = bulk.sockets.rbegin(); it != bulk.sockets.rend(); ++it) {
+        sockaddr_storage local{}, peer{};
+        socklen_t localSize = sizeof(local), peerSize = sizeof(peer);
+        if (::getsockname(*it, reinterpret_cast<sockaddr*>(&local), &localSize) == 0 &&
+            ::getpeername(*it, reinterpret_cast<sockaddr*>(&peer), &peerSize) == 0 &&
+            portOf(local) == localPort && portOf(peer) == peerPort) {
+            return *it;
+        }
+    }
+    return CURL_SOCKET_BAD;
+}
+
+void Request::openUpload() {
+    closeUpload();
+    upload.fd = ::open(uploadFilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (upload.fd < 0 || ::fstat(upload.fd, &info) != 0) {
+        closeUpload();
+        throw RequestException("Failed to open file for upload: " + uploadFilePath);
+    }
+    upload.size = static_cast<size_t>(info.st_size);
+    if (upload.size > 0) {
+        void* mapping = ::mmap(nullptr, upload.size, PROT_READ, MAP_PRIVATE, upload.fd, 0);
+        if (mapping == MAP_FAILED) {
+            closeUpload();
+            throw RequestException("Failed to map file for upload: " + uploadFilePath);
+        }
+        ::madvise(mapping, upload.size, MADV_SEQUENTIAL);
+        upload.data = static_cast<const char*>(mapping);
+    }
+
+    CURL* handle = curlHandle.get();
+    curl_easy_setopt(handle, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(upload.size));
+    curl_easy_setopt(handle, CURLOPT_READFUNCTION, uploadRead);
+    curl_easy_setopt(handle, CURLOPT_READDATA, this);
+    curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, uploadSeek);
+    curl_easy_setopt(handle, CURLOPT_SEEKDATA, this);
+    curl_easy_setopt(handle, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L); // don't wait for 100 Continue
+}
+
+void Request::closeUpload() noexcept {
+    if (upload.data) ::munmap(const_cast<char*>(upload.data), upload.size);
+    if (upload.fd >= 0) ::close(upload.fd);
+    upload.data = nullptr;
+    upload.fd = -1;
+    upload.size = 0;
+}
+
+bool Request::uploadEligible() const {
+#if defined(__linux__) && LIBCURL_VERSION_NUM < 0x080700
+    // libcurl 8.7+ fails a read callback that ends before CURLOPT_INFILESIZE_LARGE
+    if (!uploadZeroCopy || mockResponse || proxied || proxyPool ||
+        (httpVersion != HttpVersion::DEFAULT && httpVersion != HttpVersion::HTTP_1_1)) {
+        return false;
+    }
+    char* scheme = nullptr;
+    curl_easy_getinfo(curlHandle.get(), CURLINFO_SCHEME, &scheme);
+    return scheme && strcasecmp(scheme, "http") == 0;
+#else
+    return false;
+#endif
+}
+
+size_t Request::uploadRead(char* buffer, size_t size, size_t nitems, void* userp) {
+    auto* request = static_cast<Request*>(userp);
+    auto& upload = request->upload;
+    if (!upload.decided) {
+        upload.decided = true;
+        // libcurl has flushed the request headers before asking for the body
+        curl_socket_t socket = request->uploadEligible() ? request->findBulkSocket() : CURL_SOCKET_BAD;
+        if (socket != CURL_SOCKET_BAD && upload.offset == 0) {
+            upload.error = request->sendFile(socket, upload.fd, upload.size);
+            if (upload.error) return CURL_READFUNC_ABORT;
+            upload.offset = upload.size;
+            upload.sent = true;
+            return 0; // body complete as far as libcurl is concerned
+        }
+    }
+    size_t n = std::min(size * nitems, upload.size - upload.offset);
+    if (n > 0) std::memcpy(buffer, upload.data + upload.offset, n);
+    upload.offset += n;
+    return n;
+}
+
+int Request::uploadSeek(void* userp, curl_off_t offset, int origin) {
+    auto* request = static_cast<Request*>(userp);
+    auto& upload = request->upload;
+    if (upload.sent || origin != SEEK_SET || offset < 0 || static_cast<size_t>(offset) > upload.size) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    upload.offset = static_cast<size_t>(offset);
+    return CURL_SEEKFUNC_OK;
+}
+
+int Request::sendFile(curl_socket_t socket, int fd, size_t size) {
+#ifdef __linux__
+    off_t offset = 0;
+    while (static_cast<size_t>(offset) < size) {
+        ssize_t n = ::sendfile(socket, fd, &offset, size - static_cast<size_t>(offset));
+        const auto total = static_cast<curl_off_t>(size);
+        if (n > 0) {
+            if (int error = bulkCheck(bulk.startedAt, 0, 0, total, offset)) return error;
+            continue;
+        }
+        if (n == 0) return EIO; // file shrank
+        if (errno == EAGAIN) {
+            if (int error = bulkWait(socket, POLLOUT, bulk.startedAt, 0, 0, total, offset)) return error;
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+#else
+    (void)socket;
+    (void)fd;
+    (void)size;
+    return ENOSYS;
+#endif
+}
+
+int Request::bulkCheck(std::chrono::steady_clock::time_point startedAt, curl_off_t dltotal, curl_off_t dlnow,
+                       curl_off_t ultotal, curl_off_t ulnow) {
+    // libcurl does not run while we move the body, so apply its timeout and progress abort here
+    if (timeoutSeconds > 0 && std::chrono::steady_clock::now() >= startedAt + std::chrono::seconds(timeoutSeconds)) {
+        return ETIMEDOUT;
+    }
+    if (callbacks.progress && callbacks.progress(callbacks.progressData, dltotal, dlnow, ultotal, ulnow) != 0) {
+        return ECANCELED;
+    }
+    return 0;
+}
+
+int Request::bulkWait(curl_socket_t socket, short events, std::chrono::steady_clock::time_point startedAt,
+                      curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    using Clock = std::chrono::steady_clock;
+    auto until = Clock::now() + std::chrono::milliseconds(bulkStallTimeoutMs);
+    if (timeoutSeconds > 0) until = std::min(until, startedAt + std::chrono::seconds(timeoutSeconds));
+    while (true) {
+        if (int error = bulkCheck(startedAt, dltotal, dlnow, ultotal, ulnow)) return error;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - Clock::now()).count() + 1;
+        if (left <= 0) return ETIMEDOUT;
+        // Wake up every second at most, as often as libcurl calls the progress callback
+        pollfd pfd{socket, events, 0};
+        int ready = ::poll(&pfd, 1, static_cast<int>(std::min<long long>(left, 1000)));
+        if (ready > 0) return 0;
+        if (ready < 0 && errno != EINTR) return errno;
+    }
+}
+
+int Request::spliceToFile(curl_socket_t socket, int fd, curl_off_t total) {
+#ifdef __linux__
+    int pipeFds[2];
+    if (::pipe2(pipeFds, O_CLOEXEC) != 0) return errno;
+    ::fcntl(pipeFds[1], F_SETPIPE_SZ, 1 << 20); // best effort, fewer round trips
+    int error = 0;
+    curl_off_t length = total - bulk.written;
+
+    while (length > 0 && !error) {
+        ssize_t in = ::splice(socket, nullptr, pipeFds[1], nullptr, static_cast<size_t>(std::min<curl_off_t>(length, 1 << 20)),
+                              SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (in == 0) {
+            error = ECONNRESET; // closed before Content-Length bytes
+        } else if (in < 0) {
+            if (errno == EAGAIN) {
+                // libcurl's sockets are non-blocking
+                error = bulkWait(socket, POLLIN, bulk.startedAt, total, total - length, 0, 0);
+            } else if (errno != EINTR) {
+                error = errno;
+            }
+        } else {
+            length -= in;
+            while (in > 0 && !error) {
+                ssize_t out = ::splice(pipeFds[0], nullptr, fd, nullptr, static_cast<size_t>(in), SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out > 0) in -= out;
+                else if (out == 0) error = EIO;
+                else if (errno != EINTR) error = errno;
+            }
+            if (!error) error = bulkCheck(bulk.startedAt, total, total - length, 0, 0);
+        }
+    }
+
+    ::close(pipeFds[0]);
+    ::close(pipeFds[1]);
+    return error;
+#else
+    (void)socket;
+    (void)fd;
+    (void)total;
+    return ENOSYS;
+#endif
+}
+
+size_t Request::interceptHeader(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto* request = static_cast<Request*>(userdata);
+    const auto& inner = request->interception.inner;
+    size_t result = inner.header(buffer, size, nitems, inner.headerData);
+    if (result == size * nitems && detail::isHeaderBlockEnd(buffer, result)) {
+        Response& response = *request->interception.response;
+        response.httpCode = request->interception.headerContext->status;
+        for (const auto& interceptor : request->interceptors) interceptor->onHeaders(response);
+    }
+    return result;
 }
 
 void Request::setCurlHttpVersion() {
@@ -395,4 +1498,1848 @@ void Request::setCurlHttpVersion() {
     curl_easy_setopt(curlHandle.get(), CURLOPT_HTTP_VERSION, curl_http_version);
 }
 
+void Request::record(const Response& response, std::int64_t startedAtUs, const curl_slist* requestHeaders) {
+    Exchange exchange;
+    exchange.startedAtUs = startedAtUs;
+    exchange.method = methodName();
+    exchange.url = effectiveUrl;
+
+    // Credentials don't belong in a traffic log
+    for (const curl_slist* l = requestHeaders; l; l = l->next) {
+        std::string line = l->data;
+        std::string name = line.substr(0, line.find(':'));
+        detail::toLowerCase(name);
+        if (name == "authorization" || name == "proxy-authorization") {
+            line = line.substr(0, line.find(':')) + ": [redacted]";
+        }
+        exchange.requestHeaders.push_back(std::move(line));
+    }
+    exchange.requestBody = body;
+
+    exchange.httpCode = response.httpCode;
+    for (const auto& h : response.headers) {
+        for (const auto& v : h.second) exchange.responseHeaders.push_back(h.first + ": " + v);
+    }
+    exchange.responseBody = response.body;
+
+    exchange.timings = phaseTimings();
+
+    recorder->record(exchange);
+}
+
+const char* Request::methodName() const noexcept {
+    switch (method) {
+        case Method::GET:   return "GET";
+        case Method::POST:
+        case Method::MIME:  return "POST";
+        case Method::PUT:   return "PUT";
+        case Method::DEL:   return "DELETE";
+        case Method::PATCH: return "PATCH";
+        case Method::HEAD:  return "HEAD";
+    }
+    return "GET";
+}
+
+Exchange::Timings Request::phaseTimings() const {
+    Exchange::Timings t;
+    if (!mockResponse) {
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_NAMELOOKUP_TIME_T, &t.nameLookup);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_CONNECT_TIME_T, &t.connect);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_APPCONNECT_TIME_T, &t.appConnect);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_PRETRANSFER_TIME_T, &t.preTransfer);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_STARTTRANSFER_TIME_T, &t.startTransfer);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_TOTAL_TIME_T, &t.total);
+    }
+    return t;
+}
+
+void Request::reportSlow(std::int64_t startedAtUs, std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    if (elapsed < slowRequestLog->threshold() || attemptHistory.empty()) return;
+
+    SlowRequestLog::Record record;
+    record.startedAtUs = startedAtUs;
+    record.method = methodName();
+    record.url = effectiveUrl;
+    record.httpCode = attemptHistory.back().httpCode;
+    record.result = attemptHistory.back().result;
+    record.elapsed = elapsed;
+    record.timings = phaseTimings();
+    if (!mockResponse) {
+        long connects = 0;
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_NUM_CONNECTS, &connects);
+        record.reusedConnection = connects == 0;
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_SIZE_UPLOAD_T, &record.bytesSent);
+        curl_easy_getinfo(curlHandle.get(), CURLINFO_SIZE_DOWNLOAD_T, &record.bytesReceived);
+    }
+    record.attempts = attemptHistory;
+    slowRequestLog->add(std::move(record));
+}
+
+void Request::accountCost(Response& response, const detail::UsageMark& start) {
+    response.usage = detail::UsageMark::now().since(start);
+    if (!costLedger) return;
+    if (!costKey.empty()) {
+        costLedger->add(costKey, response.usage);
+        return;
+    }
+    // "METHOD /path", without scheme, authority, query or fragment
+    size_t begin = effectiveUrl.find("://");
+    begin = effectiveUrl.find('/', begin == std::string::npos ? 0 : begin + 3);
+    std::string key = methodName();
+    key += ' ';
+    if (begin == std::string::npos) {
+        key += '/';
+    } else {
+        key.append(effectiveUrl, begin, effectiveUrl.find_first_of("?#", begin) - begin);
+    }
+    costLedger->add(key, response.usage);
+}
+
+ResponseStream::ResponseStream(Request& request, size_t bufferSize)
+    : request(request),
+      headerContext{&responseHead.headers, &request.headerKeyScratch, &request.spareHeaderValues},
+      capacity(bufferSize) {
+    responseHead.httpCode = 0;
+    headerContext.store = request.pipeline.headerStore;
+    buffer.resize(capacity);
+    in.rdbuf(&streamBuffer);
+
+    request.updateTokenHeader();
+    tokenAndStatic.emplace(request.tokenHeader.get(), const_cast<curl_slist*>(request.staticHeaders));
+    headers.emplace(request.list.get(), tokenAndStatic->get());
+    CURL* handle = request.curlHandle.get();
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers->get());
+
+    FilePtr unused(nullptr);
+    std::string unusedBody;
+    request.prepareCurlOptions(headerContext, unused, unusedBody);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, this);
+    request.updateURL();
+    request.setCurlHttpVersion();
+    result = request.resolveHost();
+    done = result != CURLE_OK; // reported by the first read
+
+    multi.reset(curl_multi_init());
+    if (!multi || curl_multi_add_handle(multi.get(), handle) != CURLM_OK) {
+        throw InitializationException("Curl multi initialization failed");
+    }
+}
+
+ResponseStream::~ResponseStream() {
+    if (multi) {
+        curl_multi_remove_handle(multi.get(), request.curlHandle.get());
+    }
+    headers.reset();
+    tokenAndStatic.reset();
+    if (!request.persistent) {
+        try {
+            request.reset();
+        } catch (...) {
+            // the request is left without a handle, its next send() reports it
+        }
+    }
+}
+
+size_t ResponseStream::writeCallback(char* data, size_t size, size_t nmemb, void* userp) {
+    auto* stream = static_cast<ResponseStream*>(userp);
+    const size_t total = size * nmemb;
+    CURLING_PROBE2(write__chunk, detail::activeProbeId, total);
+    if (stream->tail + total > stream->capacity && stream->head > 0) {
+        // Compact before deciding
+        std::memmove(stream->buffer.data(), stream->buffer.data() + stream->head, stream->tail - stream->head);
+        stream->tail -= stream->head;
+        stream->head = 0;
+    }
+    if (stream->tail > 0 && stream->tail + total > stream->capacity) {
+        // Full: libcurl keeps the chunk and delivers it again once resumed
+        stream->paused = true;
+        ++stream->pauses;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (stream->tail + total > stream->buffer.size()) {
+        stream->buffer.resize(stream->tail + total); // single chunk larger than the buffer
+    }
+    std::memcpy(stream->buffer.data() + stream->tail, data, total);
+    stream->tail += total;
+    return total;
+}
+
+void ResponseStream::pump() {
+    if (paused && tail - head < capacity) {
+        paused = false;
+        curl_easy_pause(request.curlHandle.get(), CURLPAUSE_CONT);
+    }
+    int running = 0;
+    CURLMcode code = curl_multi_perform(multi.get(), &running);
+    if (code != CURLM_OK) {
+        throw RequestException(std::string("Curl multi perform failed: ") + curl_multi_strerror(code));
+    }
+    int queued = 0;
+    while (CURLMsg* message = curl_multi_info_read(multi.get(), &queued)) {
+        if (message->msg == CURLMSG_DONE) {
+            done = true;
+            result = message->data.result;
+        }
+    }
+    if (!done && tail == head && !paused) {
+        curl_multi_poll(multi.get(), nullptr, 0, 100, nullptr);
+    }
+}
+
+bool ResponseStream::fill() {
+    while (tail == head && !done) {
+        pump();
+    }
+    if (tail == head) {
+        if (result != CURLE_OK) {
+            throw RequestException(std::string("Curl stream failed: ") + curl_easy_strerror(result));
+        }
+        return false;
+    }
+    return true;
+}
+
+const Response& ResponseStream::response() {
+    while (!done && tail == head) {
+        pump();
+    }
+    curl_easy_getinfo(request.curlHandle.get(), CURLINFO_RESPONSE_CODE, &responseHead.httpCode);
+    return responseHead;
+}
+
+size_t ResponseStream::read(char* out, size_t size) {
+    if (size == 0 || !fill()) return 0;
+    size_t n = std::min(size, tail - head);
+    std::memcpy(out, buffer.data() + head, n);
+    head += n;
+    return n;
+}
+
+ResponseStream::StreamBuffer::int_type ResponseStream::StreamBuffer::underflow() {
+    // The exposed region has been consumed
+    owner.head += static_cast<size_t>(egptr() - eback());
+    setg(nullptr, nullptr, nullptr);
+    if (!owner.fill()) return traits_type::eof();
+    char* begin = owner.buffer.data() + owner.head;
+    setg(begin, begin, owner.buffer.data() + owner.tail);
+    return traits_type::to_int_type(*gptr());
+}
+
+
+SlabPool::SlabPool(int node) : node(node) {}
+
+SlabPool::~SlabPool() {
+    for (const auto& mapping : mappings) {
+        ::munmap(mapping.first, mapping.second);
+    }
+}
+
+void* SlabPool::map(size_t size, bool& huge) {
+    huge = false;
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge = p != MAP_FAILED;
+#endif
+    if (p == MAP_FAILED) {
+        // No reserved huge pages: over-map to align on 2 MB and ask for transparent huge pages
+        size_t padded = size + slabSize;
+        char* raw = static_cast<char*>(::mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) throw std::bad_alloc();
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + slabSize - 1) & ~(uintptr_t(slabSize) - 1));
+        if (aligned > raw) ::munmap(raw, static_cast<size_t>(aligned - raw));
+        size_t tail = static_cast<size_t>(raw + padded - (aligned + size));
+        if (tail > 0) ::munmap(aligned + size, tail);
+        p = aligned;
+#ifdef MADV_HUGEPAGE
+        ::madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+#ifdef __linux__
+    if (node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8)) {
+        unsigned long mask = 1UL << node;
+        const int preferred = 1; // MPOL_PREFERRED
+        ::syscall(SYS_mbind, p, size, preferred, &mask, sizeof(mask) * 8, 0);
+    }
+#endif
+    mappings.emplace_back(p, size);
+    return p;
+}
+
+void* SlabPool::newSlab() {
+    bool huge = false;
+    char* slab = static_cast<char*>(map(slabSize, huge));
+    // First touch places the slab (on the pool's node or the calling thread's)
+    auto* header = reinterpret_cast<SlabHeader*>(slab);
+    header->node = -1;
+    header->node = nodeOf(slab);
+    ++counters.slabs;
+    if (huge) ++counters.hugePageSlabs;
+    return slab;
+}
+
+void* SlabPool::allocate(size_t size) {
+    detail::allocatedBytes += size;
+    ++detail::allocationCount;
+    std::lock_guard<std::mutex> lock(mutex);
+    ++counters.allocations;
+
+    if (size > (minBlock << (classCount - 1))) {
+        bool huge = false;
+        size_t rounded = (size + slabSize - 1) & ~(slabSize - 1);
+        void* p = map(rounded, huge);
+        static_cast<char*>(p)[0] = 0;
+        countLocality(nodeOf(p));
+        return p;
+    }
+
+    size_t cls = 0;
+    while ((minBlock << cls) < size) ++cls;
+    const size_t blockSize = minBlock << cls;
+
+    void* block = freeLists[cls];
+    if (block) {
+        freeLists[cls] = *static_cast<void**>(block);
+    } else {
+        // Keep blocks aligned on their size so they never straddle the slab header
+        size_t padding = (blockSize - (reinterpret_cast<uintptr_t>(cursor) & (blockSize - 1))) & (blockSize - 1);
+        if (!cursor || remaining < padding + blockSize) {
+            cursor = static_cast<char*>(newSlab()) + minBlock; // the first block holds the header
+            remaining = slabSize - minBlock;
+            padding = (blockSize - (reinterpret_cast<uintptr_t>(cursor) & (blockSize - 1))) & (blockSize - 1);
+        }
+        cursor += padding;
+        remaining -= padding;
+        block = cursor;
+        cursor += blockSize;
+        remaining -= blockSize;
+    }
+
+    auto base = reinterpret_cast<uintptr_t>(block) & ~(uintptr_t(slabSize) - 1);
+    countLocality(reinterpret_cast<const SlabHeader*>(base)->node);
+    return block;
+}
+
+void SlabPool::deallocate(void* p, size_t size) noexcept {
+    if (!p) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size > (minBlock << (classCount - 1))) {
+        size_t rounded = (size + slabSize - 1) & ~(slabSize - 1);
+        auto it = std::find(mappings.begin(), mappings.end(), std::make_pair(p, rounded));
+        if (it != mappings.end()) {
+            ::munmap(p, rounded);
+            mappings.erase(it);
+        }
+        return;
+    }
+    size_t cls = 0;
+    while ((minBlock << cls) < size) ++cls;
+    *static_cast<void**>(p) = freeLists[cls];
+    freeLists[cls] = p;
+}
+
+SlabPool::Stats SlabPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+std::shared_ptr<SlabPool> SlabPool::forThisThread() {
+    thread_local std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+    return pool;
+}
+
+int SlabPool::currentNode() noexcept {
+#ifdef __linux__
+    unsigned cpu = 0;
+    unsigned currentNode = 0;
+    if (::syscall(SYS_getcpu, &cpu, &currentNode, nullptr) == 0) return static_cast<int>(currentNode);
+#endif
+    return -1;
+}
+
+void SlabPool::countLocality(int blockNode) noexcept {
+    int here = currentNode();
+    if (blockNode < 0 || here < 0) ++counters.unknownLocality;
+    else if (blockNode == here) ++counters.localAllocations;
+    else ++counters.remoteAllocations;
+}
+
+int SlabPool::nodeOf(const void* p) noexcept {
+#ifdef __linux__
+    void* pages[1] = {const_cast<void*>(p)};
+    int status[1] = {-1};
+    // move_pages without target nodes only reports where the page is
+    if (::syscall(SYS_move_pages, 0, 1, pages, nullptr, status, 0) == 0 && status[0] >= 0) return status[0];
+#else
+    (void)p;
+#endif
+    return -1;
+}
+
+RefreshingTokenProvider::RefreshingTokenProvider(Fetcher fetch, std::chrono::milliseconds refreshAhead,
+                                                 std::chrono::milliseconds minRefreshInterval)
+    : fetch(std::move(fetch)), refreshAhead(refreshAhead), minRefreshInterval(minRefreshInterval) {
+    if (!this->fetch) {
+        throw LogicException("RefreshingTokenProvider requires a fetch function");
+    }
+    worker = std::thread(&RefreshingTokenProvider::run, this);
+}
+
+RefreshingTokenProvider::~RefreshingTokenProvider() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(wakeupMutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    if (worker.joinable()) worker.join();
+    delete current.load();
+}
+
+std::string RefreshingTokenProvider::token() {
+    Token t;
+    unsigned long generation = 0;
+    std::chrono::steady_clock::time_point refreshAt;
+    if (peek(t, generation, refreshAt) && std::chrono::steady_clock::now() < t.expiresAt) {
+        return t.value;
+    }
+
+    // No valid token: refresh synchronously, sharing the fetch with concurrent callers
+    refreshFrom(generation);
+    peek(t, generation, refreshAt);
+    return t.value;
+}
+
+void RefreshingTokenProvider::refresh() {
+    Token t;
+    unsigned long generation = 0;
+    std::chrono::steady_clock::time_point refreshAt;
+    peek(t, generation, refreshAt);
+    refreshFrom(generation);
+}
+
+unsigned long RefreshingTokenProvider::refreshCount() const noexcept {
+    return refreshes.load();
+}
+
+bool RefreshingTokenProvider::peek(Token& out, unsigned long& generation,
+                                   std::chrono::steady_clock::time_point& refreshAt) const {
+    // Announce the read before loading the pointer: snapshots retired by a refresh
+    // are only freed once no reader is active (see refreshFrom). The last reader out
+    // frees what refreshes retired while readers were active.
+    struct ReaderGuard {
+        const RefreshingTokenProvider& provider;
+        explicit ReaderGuard(const RefreshingTokenProvider& p) : provider(p) { provider.readers.fetch_add(1); }
+        ~ReaderGuard() {
+            if (provider.readers.fetch_sub(1) == 1 && provider.hasRetired.load()) provider.drainRetired();
+        }
+    } guard(*this);
+
+    const Snapshot* snapshot = current.load();
+    if (!snapshot) {
+        generation = 0;
+        return false;
+    }
+    out = snapshot->token;
+    generation = snapshot->generation;
+
+    auto lifetime = snapshot->token.expiresAt - snapshot->obtainedAt;
+    auto ahead = std::min<std::chrono::steady_clock::duration>(refreshAhead, lifetime / 2);
+    refreshAt = snapshot->token.expiresAt - ahead;
+    return true;
+}
+
+void RefreshingTokenProvider::refreshFrom(unsigned long seenGeneration) {
+    std::lock_guard<std::mutex> lock(refreshMutex);
+
+    const Snapshot* old = current.load();
+    if (old && old->generation != seenGeneration) {
+        return; // someone else refreshed while we were waiting for the lock
+    }
+
+    Token fresh = fetch();
+    auto* snapshot = new Snapshot{std::move(fresh), std::chrono::steady_clock::now(),
+                                  old ? old->generation + 1 : 1};
+    current.store(snapshot);
+    refreshes.fetch_add(1);
+
+    if (old) {
+        std::lock_guard<std::mutex> retiredLock(retiredMutex);
+        retired.emplace_back(old);
+        hasRetired.store(true);
+    }
+    drainRetired();
+}
+
+void RefreshingTokenProvider::drainRetired() const noexcept {
+    std::unique_lock<std::mutex> lock(retiredMutex, std::try_to_lock);
+    if (!lock) return; // the holder drains
+    // Readers announce themselves before loading current, so none can still hold a retired snapshot
+    if (readers.load() == 0) {
+        retired.clear();
+        hasRetired.store(false);
+    }
+}
+
+void RefreshingTokenProvider::run() {
+    std::chrono::milliseconds backoff(0);
+    std::chrono::steady_clock::time_point retryAt;
+    std::chrono::steady_clock::time_point lastAttempt{}; // none yet: the first fetch is immediate
+
+    while (true) {
+        Token t;
+        unsigned long generation = 0;
+        std::chrono::steady_clock::time_point wakeAt = std::chrono::steady_clock::now();
+        if (peek(t, generation, wakeAt)) {
+            wakeAt = std::max(wakeAt, lastAttempt + minRefreshInterval);
+        }
+        if (backoff.count() > 0) {
+            wakeAt = retryAt;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(wakeupMutex);
+            if (wakeup.wait_until(lock, wakeAt, [this] { return stopping; })) {
+                return;
+            }
+        }
+
+        lastAttempt = std::chrono::steady_clock::now();
+        try {
+            refreshFrom(generation);
+            backoff = std::chrono::milliseconds(0);
+        } catch (...) {
+            // Keep serving the current token, retry with exponential backoff
+            backoff = backoff.count() == 0 ? std::chrono::milliseconds(1000)
+                                           : std::min(backoff * 2, std::chrono::milliseconds(30000));
+            retryAt = std::chrono::steady_clock::now() + backoff;
+            log("Token refresh failed. Retrying in " + std::to_string(backoff.count()) + "ms...");
+        }
+    }
+}
+
+ProxyPool::ProxyPool(std::vector<std::string> proxies) : ProxyPool(std::move(proxies), Options{}) {}
+
+ProxyPool::ProxyPool(std::vector<std::string> proxies, Options options)
+    : options(options), rng(std::random_device{}()) {
+    if (proxies.empty()) {
+        throw LogicException("ProxyPool requires at least one proxy");
+    }
+    entries.reserve(proxies.size());
+    for (auto& url : proxies) {
+        Entry entry;
+        entry.url = std::move(url);
+        entries.push_back(std::move(entry));
+    }
+}
+
+ProxyPool::Lease ProxyPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t index = 0;
+    released.wait(lock, [&] { return pick(index); });
+    return Lease(this, index);
+}
+
+ProxyPool::Lease ProxyPool::tryAcquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t index = 0;
+    return pick(index) ? Lease(this, index) : Lease();
+}
+
+std::vector<ProxyPool::ProxyStats> ProxyPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<ProxyStats> result;
+    result.reserve(entries.size());
+    for (const auto& e : entries) {
+        result.push_back({e.url, e.active, e.requests, e.failures, e.latencyMs, e.benchedUntil > now});
+    }
+    return result;
+}
+
+bool ProxyPool::pick(size_t& index) {
+    auto now = std::chrono::steady_clock::now();
+    auto underCap = [&](const Entry& e) {
+        return options.maxConcurrentPerProxy == 0 || e.active < options.maxConcurrentPerProxy;
+    };
+
+    std::vector<size_t> candidates;
+    candidates.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (underCap(entries[i]) && entries[i].benchedUntil <= now) candidates.push_back(i);
+    }
+
+    if (candidates.empty()) {
+        // Everything benched: rather than failing, use the proxy coming back first
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!underCap(entries[i])) continue;
+            if (candidates.empty() || entries[i].benchedUntil < entries[candidates.front()].benchedUntil) {
+                candidates.assign(1, i);
+            }
+        }
+        if (candidates.empty()) return false; // all at their cap
+    }
+
+    switch (options.policy) {
+        case Policy::RoundRobin: {
+            // First candidate at or after the cursor
+            auto it = std::find_if(candidates.begin(), candidates.end(), [&](size_t i) { return i >= cursor; });
+            index = it != candidates.end() ? *it : candidates.front();
+            cursor = (index + 1) % entries.size();
+            break;
+        }
+        case Policy::Random:
+            index = candidates[std::uniform_int_distribution<size_t>(0, candidates.size() - 1)(rng)];
+            break;
+        case Policy::LeastLoaded:
+            index = *std::min_element(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+                if (entries[a].active != entries[b].active) return entries[a].active < entries[b].active;
+                return entries[a].latencyMs < entries[b].latencyMs;
+            });
+            break;
+        case Policy::Fastest:
+            index = *std::min_element(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+                return entries[a].latencyMs < entries[b].latencyMs;
+            });
+            break;
+    }
+
+    ++entries[index].active;
+    return true;
+}
+
+void ProxyPool::release(size_t index, bool scored, bool success, std::chrono::milliseconds latency) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry& e = entries[index];
+        --e.active;
+        if (scored) {
+            ++e.requests;
+            double sample = static_cast<double>(success ? latency.count()
+                                                        : std::max(latency, options.failurePenalty).count());
+            e.latencyMs = e.requests == 1 ? sample
+                                          : options.smoothing * sample + (1.0 - options.smoothing) * e.latencyMs;
+            if (success) {
+                e.consecutiveFailures = 0;
+            } else {
+                ++e.failures;
+                if (++e.consecutiveFailures >= options.maxConsecutiveFailures) {
+                    e.benchedUntil = std::chrono::steady_clock::now() + options.cooldown;
+                    e.consecutiveFailures = 0;
+                }
+            }
+        }
+    }
+    released.notify_one();
+}
+
+ProxyPool::Lease::~Lease() {
+    if (pool) pool->release(index, false, false, std::chrono::milliseconds(0));
+}
+
+ProxyPool::Lease::Lease(Lease&& other) noexcept : pool(other.pool), index(other.index) {
+    other.pool = nullptr;
+}
+
+ProxyPool::Lease& ProxyPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        if (pool) pool->release(index, false, false, std::chrono::milliseconds(0));
+        pool = other.pool;
+        index = other.index;
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+ResolverPool::ResolverPool(size_t threads) {
+    if (threads == 0) {
+        throw LogicException("ResolverPool needs at least one thread");
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(&ResolverPool::run, this);
+    }
+}
+
+ResolverPool::~ResolverPool() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+std::future<std::vector<std::string>> ResolverPool::lookup(const std::string& host, const std::string& port) {
+    std::future<std::vector<std::string>> result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(Job{host, port, {}});
+        result = jobs.back().result.get_future();
+    }
+    queued.notify_one();
+    return result;
+}
+
+ResolverPool::Stats ResolverPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+std::shared_ptr<ResolverPool> ResolverPool::shared() {
+    static std::shared_ptr<ResolverPool> pool = std::make_shared<ResolverPool>();
+    return pool;
+}
+
+void ResolverPool::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        int rc = ::getaddrinfo(job.host.c_str(), job.port.c_str(), &hints, &found);
+
+        std::vector<std::string> addresses;
+        for (addrinfo* ai = found; ai; ai = ai->ai_next) {
+            char text[INET6_ADDRSTRLEN];
+            if (ai->ai_family == AF_INET) {
+                ::inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(ai->ai_addr)->sin_addr, text, sizeof(text));
+                addresses.emplace_back(text);
+            } else if (ai->ai_family == AF_INET6) {
+                ::inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(ai->ai_addr)->sin6_addr, text, sizeof(text));
+                addresses.push_back(std::string("[") + text + "]");
+            }
+        }
+        if (found) ::freeaddrinfo(found);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++counters.lookups;
+            if (addresses.empty()) ++counters.failures;
+        }
+        if (addresses.empty()) {
+            job.result.set_exception(std::make_exception_ptr(RequestException(
+                "Could not resolve host " + job.host + ": " + (rc ? ::gai_strerror(rc) : "no address"))));
+        } else {
+            job.result.set_value(std::move(addresses));
+        }
+    }
+}
+
+DnsCache::DnsCache(std::shared_ptr<ResolverPool> resolver) : DnsCache(std::move(resolver), Options{}) {}
+
+DnsCache::DnsCache(std::shared_ptr<ResolverPool> resolver, Options options)
+    : resolver(resolver ? std::move(resolver) : ResolverPool::shared()), options(options) {
+    if (options.maxEntries == 0) {
+        throw LogicException("DnsCache maxEntries must be greater than zero");
+    }
+}
+
+bool DnsCache::ready(const std::shared_future<std::vector<std::string>>& f) {
+    return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void DnsCache::settle(Entry& entry, Clock::time_point now) {
+    if (entry.refresh.valid() && ready(entry.refresh)) {
+        // A failed refresh keeps the previous addresses until they expire
+        bool refreshFailed = false;
+        try { entry.refresh.get(); } catch (const RequestException&) { refreshFailed = true; }
+        if (!refreshFailed || !entry.settled || entry.failed || now >= entry.expiresAt) {
+            entry.addresses = entry.refresh;
+            entry.settled = false;
+        }
+        entry.refresh = {};
+    }
+    if (!entry.settled && ready(entry.addresses)) {
+        entry.failed = false;
+        try { entry.addresses.get(); } catch (const RequestException&) { entry.failed = true; }
+        entry.expiresAt = now + (entry.failed ? options.negativeTtl : options.ttl);
+        entry.settled = true;
+    }
+}
+
+void DnsCache::evict(Clock::time_point now) {
+    for (auto it = entries.begin(); it != entries.end() && entries.size() >= options.maxEntries;) {
+        if (it->second.settled && now >= it->second.expiresAt) it = entries.erase(it);
+        else ++it;
+    }
+    while (entries.size() >= options.maxEntries) {
+        auto oldest = std::min_element(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+            return a.second.insertedAt < b.second.insertedAt;
+        });
+        entries.erase(oldest);
+    }
+}
+
+std::shared_future<std::vector<std::string>> DnsCache::lookup(const std::string& host, const std::string& port) {
+    const auto now = Clock::now();
+    std::string key = host + ":" + port;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        Entry& entry = it->second;
+        settle(entry, now);
+        if (!entry.settled) {
+            ++counters.hits; // joins the lookup in flight
+            return entry.addresses;
+        }
+        if (now < entry.expiresAt) {
+            if (entry.failed) {
+                ++counters.negativeHits;
+            } else {
+                ++counters.hits;
+                if (!entry.refresh.valid() && now + options.refreshAhead >= entry.expiresAt) {
+                    ++counters.refreshes;
+                    entry.refresh = resolver->lookup(host, port).share();
+                }
+            }
+            return entry.addresses;
+        }
+        if (entry.refresh.valid()) {
+            // Expired while a refresh is running: wait for that one
+            ++counters.hits;
+            entry.addresses = entry.refresh;
+            entry.refresh = {};
+            entry.settled = false;
+            return entry.addresses;
+        }
+        ++counters.misses;
+        entry.addresses = resolver->lookup(host, port).share();
+        entry.settled = false;
+        return entry.addresses;
+    }
+
+    ++counters.misses;
+    if (entries.size() >= options.maxEntries) evict(now);
+    Entry entry;
+    entry.addresses = resolver->lookup(host, port).share();
+    entry.insertedAt = now;
+    auto addresses = entry.addresses;
+    entries.emplace(std::move(key), std::move(entry));
+    return addresses;
+}
+
+void DnsCache::prefetch(const std::string& host, const std::string& port) {
+    lookup(host, port);
+}
+
+void DnsCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+DnsCache::Stats DnsCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats out = counters;
+    out.entries = entries.size();
+    return out;
+}
+
+std::shared_ptr<DnsCache> DnsCache::shared() {
+    static std::shared_ptr<DnsCache> cache = std::make_shared<DnsCache>();
+    return cache;
+}
+
+SourceAddressPool::SourceAddressPool(std::vector<std::string> addresses) {
+    if (addresses.empty()) {
+        throw LogicException("SourceAddressPool requires at least one address");
+    }
+    entries.reserve(addresses.size());
+    for (auto& address : addresses) {
+        Entry entry;
+        entry.address = std::move(address);
+        entries.push_back(std::move(entry));
+    }
+}
+
+SourceAddressPool::Lease SourceAddressPool::acquire(const std::string& host, long preferred) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& active = activeByHost[host];
+    active.resize(entries.size());
+
+    size_t slot = 0;
+    if (preferred >= 0 && static_cast<size_t>(preferred) < entries.size()) {
+        slot = static_cast<size_t>(preferred);
+    } else {
+        // Fewest attempts in flight to this host, then overall, rotating among ties
+        bool found = false;
+        for (size_t n = 0; n < entries.size(); ++n) {
+            size_t i = (cursor + n) % entries.size();
+            if (!found || active[i] < active[slot] ||
+                (active[i] == active[slot] && entries[i].active < entries[slot].active)) {
+                slot = i;
+                found = true;
+            }
+        }
+        cursor = (slot + 1) % entries.size();
+    }
+    ++active[slot];
+    ++entries[slot].active;
+    ++entries[slot].requests;
+    return Lease(this, slot, host);
+}
+
+std::vector<SourceAddressPool::AddressStats> SourceAddressPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<AddressStats> result;
+    result.reserve(entries.size());
+    for (const auto& e : entries) {
+        result.push_back(AddressStats{e.address, e.active, e.requests, e.connections});
+    }
+    return result;
+}
+
+void SourceAddressPool::release(size_t slot, const std::string& host) {
+    std::lock_guard<std::mutex> lock(mutex);
+    --entries[slot].active;
+    auto it = activeByHost.find(host);
+    if (it != activeByHost.end() && --it->second[slot] == 0 &&
+        std::all_of(it->second.begin(), it->second.end(), [](unsigned n) { return n == 0; })) {
+        activeByHost.erase(it);
+    }
+}
+
+SourceAddressPool::Lease::~Lease() {
+    if (pool) pool->release(slot, host);
+}
+
+SourceAddressPool::Lease::Lease(Lease&& other) noexcept
+    : pool(other.pool), slot(other.slot), host(std::move(other.host)) {
+    other.pool = nullptr;
+}
+
+SourceAddressPool::Lease& SourceAddressPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        if (pool) pool->release(slot, host);
+        pool = other.pool;
+        slot = other.slot;
+        host = std::move(other.host);
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+const std::string& SourceAddressPool::Lease::address() const {
+    if (!pool) throw LogicException("Empty source address lease");
+    return pool->entries[slot].address;
+}
+
+void SourceAddressPool::Lease::connected() {
+    if (!pool) return;
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    ++pool->entries[slot].connections;
+}
+
+struct InFlightRegistry::Slot {
+    static constexpr size_t urlWords = (urlCapacity + 1) / sizeof(std::uint64_t);
+
+    std::atomic<int> state{0}; // 0 free, 1 being written, 2 published
+    std::atomic<std::uint64_t> sequence{0}; // odd while the slot changes owner
+    std::atomic<std::uint64_t> id{0};
+    std::atomic<std::uint64_t> url[urlWords] = {};
+    std::atomic<std::uint32_t> urlLength{0};
+    std::atomic<std::uint8_t> phase{0};
+    std::atomic<curl_off_t> received{0};
+    std::atomic<curl_off_t> sent{0};
+    std::atomic<std::int64_t> startedAtNs{0};
+    std::atomic<unsigned> attempt{0};
+    std::atomic<curl_off_t> connectionId{-1};
+};
+
+InFlightRegistry::InFlightRegistry(size_t capacity) : slots(new Slot[capacity]), capacity(capacity) {
+    if (capacity == 0) {
+        throw LogicException("InFlightRegistry capacity must be greater than zero");
+    }
+}
+
+InFlightRegistry::~InFlightRegistry() = default;
+
+InFlightRegistry::Registration InFlightRegistry::enter(const std::shared_ptr<InFlightRegistry>& registry, const std::string& url) {
+    Registration registration;
+    if (!registry) return registration;
+    const size_t start = registry->hint.fetch_add(1, std::memory_order_relaxed);
+    for (size_t n = 0; n < registry->capacity; ++n) {
+        Slot& slot = registry->slots[(start + n) % registry->capacity];
+        int expected = 0;
+        if (slot.state.load(std::memory_order_relaxed) != 0 ||
+            !slot.state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+            continue;
+        }
+        slot.sequence.fetch_add(1, std::memory_order_acq_rel);
+        slot.id.store(registry->nextId.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        const size_t length = std::min(url.size(), urlCapacity);
+        for (size_t w = 0; w * sizeof(std::uint64_t) < length; ++w) {
+            std::uint64_t word = 0;
+            std::memcpy(&word, url.data() + w * sizeof(word), std::min(sizeof(word), length - w * sizeof(word)));
+            slot.url[w].store(word, std::memory_order_relaxed);
+        }
+        slot.urlLength.store(static_cast<std::uint32_t>(length), std::memory_order_relaxed);
+        slot.phase.store(static_cast<std::uint8_t>(Phase::Resolving), std::memory_order_relaxed);
+        slot.received.store(0, std::memory_order_relaxed);
+        slot.sent.store(0, std::memory_order_relaxed);
+        slot.startedAtNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+        slot.attempt.store(1, std::memory_order_relaxed);
+        slot.connectionId.store(-1, std::memory_order_relaxed);
+        slot.sequence.fetch_add(1, std::memory_order_release);
+        slot.state.store(2, std::memory_order_release);
+        registration.registry = registry;
+        registration.slot = &slot;
+        return registration;
+    }
+    registry->droppedCount.fetch_add(1, std::memory_order_relaxed);
+    return registration;
+}
+
+std::vector<InFlightRegistry::Transfer> InFlightRegistry::snapshot() const {
+    std::vector<Transfer> transfers;
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    for (size_t i = 0; i < capacity; ++i) {
+        const Slot& slot = slots[i];
+        if (slot.state.load(std::memory_order_acquire) != 2) continue;
+        const std::uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        if (before & 1) continue;
+
+        Transfer t;
+        t.id = slot.id.load(std::memory_order_relaxed);
+        const size_t length = std::min<size_t>(slot.urlLength.load(std::memory_order_relaxed), urlCapacity);
+        t.url.resize(length);
+        for (size_t w = 0; w * sizeof(std::uint64_t) < length; ++w) {
+            std::uint64_t word = slot.url[w].load(std::memory_order_relaxed);
+            std::memcpy(&t.url[w * sizeof(word)], &word, std::min(sizeof(word), length - w * sizeof(word)));
+        }
+        t.phase = static_cast<Phase>(slot.phase.load(std::memory_order_relaxed));
+        t.bytesReceived = slot.received.load(std::memory_order_relaxed);
+        t.bytesSent = slot.sent.load(std::memory_order_relaxed);
+        t.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - std::chrono::nanoseconds(slot.startedAtNs.load(std::memory_order_relaxed)));
+        t.attempt = slot.attempt.load(std::memory_order_relaxed);
+        t.connectionId = slot.connectionId.load(std::memory_order_relaxed);
+
+        // The slot changed owner while being read: that transfer is over
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != before || slot.state.load(std::memory_order_relaxed) != 2) {
+            continue;
+        }
+        transfers.push_back(std::move(t));
+    }
+    std::sort(transfers.begin(), transfers.end(), [](const Transfer& a, const Transfer& b) { return a.id < b.id; });
+    return transfers;
+}
+
+std::string InFlightRegistry::toJson() const {
+    std::string out = "{\"dropped\":" + std::to_string(dropped()) + ",\"transfers\":[";
+    bool first = true;
+    for (const auto& t : snapshot()) {
+        if (!first) out.push_back(',');
+        first = false;
+        out += "{\"id\":" + std::to_string(t.id) + ",\"url\":";
+        detail::appendJsonString(out, t.url);
+        out += ",\"phase\":\"";
+        out += phaseName(t.phase);
+        out += "\",\"bytesReceived\":" + std::to_string(t.bytesReceived) +
+               ",\"bytesSent\":" + std::to_string(t.bytesSent) +
+               ",\"elapsedMs\":" + std::to_string(t.elapsed.count()) +
+               ",\"attempt\":" + std::to_string(t.attempt) +
+               ",\"connectionId\":" + std::to_string(t.connectionId) + "}";
+    }
+    out += "]}";
+    return out;
+}
+
+const char* InFlightRegistry::phaseName(Phase phase) noexcept {
+    switch (phase) {
+        case Phase::Resolving:    return "resolving";
+        case Phase::Connecting:   return "connecting";
+        case Phase::TlsHandshake: return "tls";
+        case Phase::Sending:      return "sending";
+        case Phase::Waiting:      return "waiting";
+        case Phase::Receiving:    return "receiving";
+        case Phase::Backoff:      return "backoff";
+    }
+    return "unknown";
+}
+
+InFlightRegistry::Registration::~Registration() {
+    release();
+}
+
+void InFlightRegistry::Registration::release() noexcept {
+    if (!slot) return;
+    slot->sequence.fetch_add(1, std::memory_order_acq_rel);
+    slot->state.store(0, std::memory_order_release);
+    slot->sequence.fetch_add(1, std::memory_order_release);
+    slot = nullptr;
+    registry.reset();
+}
+
+InFlightRegistry::Registration::Registration(Registration&& other) noexcept
+    : registry(std::move(other.registry)), slot(other.slot) {
+    other.slot = nullptr;
+}
+
+InFlightRegistry::Registration& InFlightRegistry::Registration::operator=(Registration&& other) noexcept {
+    if (this != &other) {
+        release();
+        registry = std::move(other.registry);
+        slot = other.slot;
+        other.slot = nullptr;
+    }
+    return *this;
+}
+
+void InFlightRegistry::Registration::update(Phase phase, curl_off_t received, curl_off_t sent, curl_off_t connectionId) noexcept {
+    if (!slot) return;
+    slot->phase.store(static_cast<std::uint8_t>(phase), std::memory_order_relaxed);
+    slot->received.store(received, std::memory_order_relaxed);
+    slot->sent.store(sent, std::memory_order_relaxed);
+    slot->connectionId.store(connectionId, std::memory_order_relaxed);
+}
+
+void InFlightRegistry::Registration::setAttempt(unsigned attempt) noexcept {
+    if (slot) slot->attempt.store(attempt, std::memory_order_relaxed);
+}
+
+void InFlightRegistry::Registration::setPhase(Phase phase) noexcept {
+    if (slot) slot->phase.store(static_cast<std::uint8_t>(phase), std::memory_order_relaxed);
+}
+
+SlowRequestLog::SlowRequestLog(std::chrono::milliseconds threshold, size_t capacity)
+    : limit(threshold), capacity(capacity) {
+    if (capacity == 0) {
+        throw LogicException("SlowRequestLog capacity must be greater than zero");
+    }
+    ring.reserve(capacity);
+}
+
+void SlowRequestLog::add(Record record) {
+    std::string line = record.toString();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ring.size() < capacity) {
+            ring.push_back(std::move(record));
+        } else {
+            ring[next] = std::move(record);
+        }
+        next = (next + 1) % capacity;
+        ++count;
+    }
+    log(line);
+}
+
+std::vector<SlowRequestLog::Record> SlowRequestLog::records() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ring.size() < capacity) return ring;
+    std::vector<Record> ordered;
+    ordered.reserve(capacity);
+    for (size_t i = 0; i < capacity; ++i) ordered.push_back(ring[(next + i) % capacity]);
+    return ordered;
+}
+
+unsigned long SlowRequestLog::total() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+std::string SlowRequestLog::Record::toString() const {
+    auto ms = [](curl_off_t us) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.1f", static_cast<double>(us) / 1000.0);
+        return std::string(text);
+    };
+    auto span = [](curl_off_t from, curl_off_t to) { return to > from ? to - from : curl_off_t(0); };
+
+    std::string out = "Slow request: " + method + " " + url + " -> " + std::to_string(httpCode) +
+                      " in " + ms(elapsed.count()) + " ms";
+    out += " (dns " + ms(timings.nameLookup) +
+           ", connect " + ms(span(timings.nameLookup, timings.connect)) +
+           ", tls " + ms(timings.appConnect ? span(timings.connect, timings.appConnect) : 0) +
+           ", ttfb " + ms(span(timings.preTransfer, timings.startTransfer)) +
+           ", transfer " + ms(span(timings.startTransfer, timings.total)) + " ms)";
+    out += reusedConnection ? ", reused connection" : ", new connection";
+    out += ", sent " + std::to_string(bytesSent) + " B, received " + std::to_string(bytesReceived) + " B";
+    out += ", attempts [";
+    for (size_t i = 0; i < attempts.size(); ++i) {
+        if (i) out += "; ";
+        out += std::to_string(attempts[i].httpCode) + " " + curl_easy_strerror(attempts[i].result) +
+               " " + ms(attempts[i].elapsed.count()) + " ms";
+    }
+    out += "]";
+    return out;
+}
+
+void CostLedger::add(const std::string& key, const ResourceUsage& usage) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry& entry = totals[key];
+    if (entry.key.empty()) entry.key = key;
+    ++entry.requests;
+    entry.cpu += usage.cpu;
+    entry.allocatedBytes += usage.allocatedBytes;
+    entry.allocations += usage.allocations;
+}
+
+std::vector<CostLedger::Entry> CostLedger::entries() const {
+    std::vector<Entry> out;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        out.reserve(totals.size());
+        for (const auto& kv : totals) out.push_back(kv.second);
+    }
+    std::sort(out.begin(), out.end(), [](const Entry& a, const Entry& b) { return a.cpu > b.cpu; });
+    return out;
+}
+
+void CostLedger::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    totals.clear();
+}
+
+std::shared_ptr<CostLedger> CostLedger::shared() {
+    static std::shared_ptr<CostLedger> ledger = std::make_shared<CostLedger>();
+    return ledger;
+}
+
+HdrHistogram::HdrHistogram(std::uint64_t highestTrackable, int significantDigits)
+    : layout(highestTrackable, significantDigits), counts(layout.countsLength) {}
+
+void HdrHistogram::record(std::uint64_t value, std::uint64_t times) noexcept {
+    if (value > layout.highestTrackable) value = layout.highestTrackable;
+    counts[layout.index(value)] += times;
+    total += times;
+    sum += value * times;
+    lowest = std::min(lowest, value);
+    highest = std::max(highest, value);
+}
+
+void HdrHistogram::merge(const HdrHistogram& other) {
+    if (!(layout == other.layout)) {
+        throw LogicException("Cannot merge HDR histograms with different range or precision");
+    }
+    for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    lowest = std::min(lowest, other.lowest);
+    highest = std::max(highest, other.highest);
+}
+
+std::uint64_t HdrHistogram::percentile(double percentile) const noexcept {
+    if (total == 0) return 0;
+    if (percentile <= 0.0) return min();
+    const double fraction = std::min(percentile, 100.0) / 100.0;
+    std::uint64_t rank = static_cast<std::uint64_t>(std::ceil(fraction * static_cast<double>(total)));
+    if (rank == 0) rank = 1;
+    std::uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(layout.highestAt(i), highest);
+    }
+    return highest;
+}
+
+void HdrHistogram::clear() noexcept {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    sum = 0;
+    lowest = UINT64_MAX;
+    highest = 0;
+}
+
+std::string HdrHistogram::serialize() const {
+    std::string out = "HDR1 " + std::to_string(layout.highestTrackable) + " " +
+                      std::to_string(layout.significantDigits) + " " + std::to_string(lowest) + " " +
+                      std::to_string(highest) + " " + std::to_string(sum);
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0) continue;
+        out += " " + std::to_string(i) + ":" + std::to_string(counts[i]);
+    }
+    return out;
+}
+
+HdrHistogram HdrHistogram::deserialize(const std::string& text) {
+    std::istringstream in(text);
+    std::string magic;
+    std::uint64_t highestTrackable = 0, lowestValue = 0, highestValue = 0, sumValue = 0;
+    int digits = 0;
+    if (!(in >> magic >> highestTrackable >> digits >> lowestValue >> highestValue >> sumValue) || magic != "HDR1") {
+        throw LogicException("Malformed HDR histogram");
+    }
+    HdrHistogram histogram(highestTrackable, digits);
+    std::string pair;
+    while (in >> pair) {
+        size_t colon = pair.find(':');
+        std::uint64_t index = 0, count = 0;
+        if (colon == std::string::npos ||
+            std::from_chars(pair.data(), pair.data() + colon, index).ec != std::errc() ||
+            std::from_chars(pair.data() + colon + 1, pair.data() + pair.size(), count).ec != std::errc() ||
+            index >= histogram.counts.size()) {
+            throw LogicException("Malformed HDR histogram entry: " + pair);
+        }
+        histogram.counts[index] += count;
+        histogram.total += count;
+    }
+    histogram.sum = sumValue;
+    histogram.lowest = lowestValue;
+    histogram.highest = highestValue;
+    return histogram;
+}
+
+std::string HdrHistogram::summary() const {
+    return "count " + std::to_string(total) + ", min " + std::to_string(min()) +
+           ", p50 " + std::to_string(percentile(50.0)) + ", p90 " + std::to_string(percentile(90.0)) +
+           ", p99 " + std::to_string(percentile(99.0)) + ", p99.9 " + std::to_string(percentile(99.9)) +
+           ", max " + std::to_string(max());
+}
+
+ShardedHistogram::ShardedHistogram(std::uint64_t highestTrackable, int significantDigits, unsigned shards)
+    : layout(highestTrackable, significantDigits) {
+    if (shards == 0) shards = std::max(1u, std::min(64u, std::thread::hardware_concurrency()));
+    shardCount = shards;
+    this->shards = std::make_unique<Shard[]>(shardCount);
+}
+
+ShardedHistogram::~ShardedHistogram() {
+    for (unsigned i = 0; i < shardCount; ++i) delete[] shards[i].counts.load(std::memory_order_relaxed);
+}
+
+void ShardedHistogram::record(std::uint64_t value) noexcept {
+    if (value > layout.highestTrackable) value = layout.highestTrackable;
+    Shard& shard = shards[detail::histogramShard % shardCount];
+    std::atomic<std::uint64_t>* counts = shard.counts.load(std::memory_order_acquire);
+    if (!counts) {
+        auto* fresh = new (std::nothrow) std::atomic<std::uint64_t>[layout.countsLength]();
+        if (!fresh) return;
+        if (shard.counts.compare_exchange_strong(counts, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            counts = fresh;
+        } else {
+            delete[] fresh; // another thread of this shard got there first
+        }
+    }
+    counts[layout.index(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.total.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    std::uint64_t seen = shard.lowest.load(std::memory_order_relaxed);
+    while (value < seen && !shard.lowest.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    seen = shard.highest.load(std::memory_order_relaxed);
+    while (value > seen && !shard.highest.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+HdrHistogram ShardedHistogram::snapshot() const {
+    HdrHistogram merged(layout.highestTrackable, layout.significantDigits);
+    for (unsigned s = 0; s < shardCount; ++s) {
+        const Shard& shard = shards[s];
+        const std::atomic<std::uint64_t>* counts = shard.counts.load(std::memory_order_acquire);
+        if (!counts) continue;
+        for (size_t i = 0; i < layout.countsLength; ++i) {
+            std::uint64_t count = counts[i].load(std::memory_order_relaxed);
+            merged.counts[i] += count;
+            merged.total += count;
+        }
+        merged.sum += shard.sum.load(std::memory_order_relaxed);
+        merged.lowest = std::min(merged.lowest, shard.lowest.load(std::memory_order_relaxed));
+        merged.highest = std::max(merged.highest, shard.highest.load(std::memory_order_relaxed));
+    }
+    return merged;
+}
+
+void ShardedHistogram::reset() noexcept {
+    for (unsigned s = 0; s < shardCount; ++s) {
+        Shard& shard = shards[s];
+        if (auto* counts = shard.counts.load(std::memory_order_acquire)) {
+            for (size_t i = 0; i < layout.countsLength; ++i) counts[i].store(0, std::memory_order_relaxed);
+        }
+        shard.total.store(0, std::memory_order_relaxed);
+        shard.sum.store(0, std::memory_order_relaxed);
+        shard.lowest.store(UINT64_MAX, std::memory_order_relaxed);
+        shard.highest.store(0, std::memory_order_relaxed);
+    }
+}
+
+LatencyTracker::LatencyTracker(std::uint64_t highestTrackable, int significantDigits)
+    : highestTrackable(highestTrackable), significantDigits(significantDigits) {
+    (void)detail::HdrLayout(highestTrackable, significantDigits); // validates the arguments
+}
+
+std::shared_ptr<LatencyTracker::Phases> LatencyTracker::phasesOf(const std::string& host) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& phases = byHost[host];
+    if (!phases) {
+        phases = std::make_shared<Phases>();
+        for (auto& histogram : *phases) {
+            histogram = std::make_unique<ShardedHistogram>(highestTrackable, significantDigits);
+        }
+    }
+    return phases;
+}
+
+void LatencyTracker::record(const std::string& host, const Exchange::Timings& timings, bool newConnection) {
+    auto phases = phasesOf(host);
+    auto span = [](curl_off_t from, curl_off_t to) { return to > from ? static_cast<std::uint64_t>(to - from) : 0; };
+    auto add = [&](Phase phase, std::uint64_t us) { (*phases)[static_cast<size_t>(phase)]->record(us); };
+
+    if (newConnection) {
+        add(Phase::Dns, static_cast<std::uint64_t>(timings.nameLookup));
+        add(Phase::Connect, span(timings.nameLookup, timings.connect));
+        if (timings.appConnect) add(Phase::Tls, span(timings.connect, timings.appConnect));
+    }
+    if (timings.startTransfer) {
+        add(Phase::FirstByte, span(timings.preTransfer, timings.startTransfer));
+        add(Phase::Transfer, span(timings.startTransfer, timings.total));
+    }
+    add(Phase::Total, static_cast<std::uint64_t>(timings.total));
+}
+
+HdrHistogram LatencyTracker::histogram(const std::string& host, Phase phase) const {
+    std::shared_ptr<Phases> phases;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = byHost.find(host);
+        if (it != byHost.end()) phases = it->second;
+    }
+    if (!phases) return HdrHistogram(highestTrackable, significantDigits);
+    return (*phases)[static_cast<size_t>(phase)]->snapshot();
+}
+
+std::vector<std::string> LatencyTracker::hosts() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> out;
+    out.reserve(byHost.size());
+    for (const auto& kv : byHost) out.push_back(kv.first);
+    return out;
+}
+
+std::string LatencyTracker::report() const {
+    std::string out;
+    for (const auto& host : hosts()) {
+        for (size_t p = 0; p < phaseCount; ++p) {
+            HdrHistogram h = histogram(host, static_cast<Phase>(p));
+            if (h.count() == 0) continue;
+            out += host + " " + phaseName(static_cast<Phase>(p)) + " us: " + h.summary() + "\n";
+        }
+    }
+    return out;
+}
+
+const char* LatencyTracker::phaseName(Phase phase) noexcept {
+    switch (phase) {
+    case Phase::Dns: return "dns";
+    case Phase::Connect: return "connect";
+    case Phase::Tls: return "tls";
+    case Phase::FirstByte: return "ttfb";
+    case Phase::Transfer: return "transfer";
+    case Phase::Total: return "total";
+    }
+    return "unknown";
+}
+
+const std::string& ProxyPool::Lease::proxy() const {
+    if (!pool) throw LogicException("Empty proxy lease");
+    return pool->entries[index].url;
+}
+
+void ProxyPool::Lease::complete(bool success, std::chrono::milliseconds latency) {
+    if (!pool) return;
+    pool->release(index, true, success, latency);
+    pool = nullptr;
+}
+
+void TrafficLog::encode(const Exchange& e, std::string& out) {
+    std::string record;
+    detail::putVarint(record, static_cast<std::uint64_t>(e.startedAtUs));
+    detail::putString(record, e.method);
+    detail::putString(record, e.url);
+    detail::putVarint(record, e.requestHeaders.size());
+    for (const auto& h : e.requestHeaders) detail::putString(record, h);
+    detail::putString(record, e.requestBody);
+    detail::putVarint(record, static_cast<std::uint64_t>(e.httpCode));
+    detail::putVarint(record, e.responseHeaders.size());
+    for (const auto& h : e.responseHeaders) detail::putString(record, h);
+    detail::putString(record, e.responseBody);
+    for (curl_off_t t : {e.timings.nameLookup, e.timings.connect, e.timings.appConnect,
+                         e.timings.preTransfer, e.timings.startTransfer, e.timings.total}) {
+        detail::putVarint(record, static_cast<std::uint64_t>(t));
+    }
+
+    detail::putVarint(out, record.size());
+    out.append(record);
+}
+
+bool TrafficLog::decode(const std::string& in, size_t& pos, Exchange& e) {
+    std::uint64_t size = 0, v = 0;
+    if (!detail::getVarint(in, pos, size) || size > in.size() - pos) return false;
+    const std::string record = in.substr(pos, static_cast<size_t>(size));
+    pos += static_cast<size_t>(size);
+
+    size_t p = 0;
+    auto getStrings = [&](std::vector<std::string>& lines) {
+        std::uint64_t n = 0;
+        if (!detail::getVarint(record, p, n)) return false;
+        lines.resize(static_cast<size_t>(n));
+        for (auto& line : lines) {
+            if (!detail::getString(record, p, line)) return false;
+        }
+        return true;
+    };
+
+    if (!detail::getVarint(record, p, v)) return false;
+    e.startedAtUs = static_cast<std::int64_t>(v);
+    if (!detail::getString(record, p, e.method) || !detail::getString(record, p, e.url) ||
+        !getStrings(e.requestHeaders) || !detail::getString(record, p, e.requestBody)) return false;
+    if (!detail::getVarint(record, p, v)) return false;
+    e.httpCode = static_cast<long>(v);
+    if (!getStrings(e.responseHeaders) || !detail::getString(record, p, e.responseBody)) return false;
+    for (curl_off_t* t : {&e.timings.nameLookup, &e.timings.connect, &e.timings.appConnect,
+                          &e.timings.preTransfer, &e.timings.startTransfer, &e.timings.total}) {
+        if (!detail::getVarint(record, p, v)) return false;
+        *t = static_cast<curl_off_t>(v);
+    }
+    return true;
+}
+
+TrafficLog TrafficLog::load(const std::string& path) {
+    FilePtr file(std::fopen(path.c_str(), "rb"));
+    if (!file) {
+        throw CurlingException("Failed to open traffic log: " + path);
+    }
+    std::string data;
+    char buffer[65536];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+        data.append(buffer, n);
+    }
+
+    const size_t magicSize = sizeof(TrafficLog::magic) - 1;
+    if (data.compare(0, magicSize, TrafficLog::magic) != 0) {
+        throw CurlingException("Not a curling traffic log: " + path);
+    }
+
+    TrafficLog log;
+    size_t pos = magicSize;
+    while (pos < data.size()) {
+        Exchange e;
+        if (!decode(data, pos, e)) {
+            throw CurlingException("Corrupted traffic log: " + path);
+        }
+        log.exchanges.push_back(std::move(e));
+    }
+    return log;
+}
+
+void TrafficLog::save(const std::string& path) const {
+    std::string data(magic);
+    for (const auto& e : exchanges) encode(e, data);
+
+    FilePtr file(std::fopen(path.c_str(), "wb"));
+    if (!file || std::fwrite(data.data(), 1, data.size(), file.get()) != data.size()) {
+        throw CurlingException("Failed to write traffic log: " + path);
+    }
+}
+
+std::string TrafficLog::toHar() const {
+    auto ms = [](curl_off_t us) { return std::to_string(static_cast<double>(us) / 1000.0); };
+    auto phase = [&](curl_off_t from, curl_off_t to) { return to > 0 && to >= from ? ms(to - from) : std::string("-1"); };
+    auto headers = [](std::string& out, const std::vector<std::string>& lines) {
+        out += '[';
+        for (size_t i = 0; i < lines.size(); ++i) {
+            auto colon = lines[i].find(':');
+            std::string name = lines[i].substr(0, colon);
+            std::string value = colon == std::string::npos ? "" : lines[i].substr(colon + 1);
+            detail::trim(value);
+            out += i ? ",{\"name\":" : "{\"name\":";
+            detail::appendJsonString(out, name);
+            out += ",\"value\":";
+            detail::appendJsonString(out, value);
+            out += '}';
+        }
+        out += ']';
+    };
+    auto content = [](std::string& out, const std::string& body) {
+        // Binary bodies are base64 encoded, as HAR allows
+        bool binary = std::any_of(body.begin(), body.end(), [](unsigned char c) {
+            return (c < 0x20 && c != '\n' && c != '\r' && c != '\t') || c >= 0x80;
+        });
+        if (!binary) {
+            detail::appendJsonString(out, body);
+            return;
+        }
+        static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        out += '"';
+        for (size_t i = 0; i < body.size(); i += 3) {
+            std::uint32_t n = static_cast<unsigned char>(body[i]) << 16;
+            if (i + 1 < body.size()) n |= static_cast<unsigned char>(body[i + 1]) << 8;
+            if (i + 2 < body.size()) n |= static_cast<unsigned char>(body[i + 2]);
+            out += b64[(n >> 18) & 63];
+            out += b64[(n >> 12) & 63];
+            out += i + 1 < body.size() ? b64[(n >> 6) & 63] : '=';
+            out += i + 2 < body.size() ? b64[n & 63] : '=';
+        }
+        out += "\",\"encoding\":\"base64\"";
+    };
+
+    std::string out = "{\"log\":{\"version\":\"1.2\",\"creator\":{\"name\":\"curling\",\"version\":\"" + version() + "\"},\"entries\":[";
+    for (size_t i = 0; i < exchanges.size(); ++i) {
+        const Exchange& e = exchanges[i];
+        const auto& t = e.timings;
+
+        std::time_t seconds = static_cast<std::time_t>(e.startedAtUs / 1000000);
+        std::tm utc{};
+        gmtime_r(&seconds, &utc);
+        char started[64];
+        std::snprintf(started, sizeof(started), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", utc.tm_year + 1900,
+                      utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+                      static_cast<int>((e.startedAtUs / 1000) % 1000));
+
+        std::string mimeType;
+        for (const auto& h : e.responseHeaders) {
+            if (h.compare(0, 13, "content-type:") == 0) {
+                mimeType = h.substr(13);
+                detail::trim(mimeType);
+            }
+        }
+
+        out += i ? ",{" : "{";
+        out += "\"startedDateTime\":\"" + std::string(started) + "\",\"time\":" + ms(t.total);
+        out += ",\"request\":{\"method\":";
+        detail::appendJsonString(out, e.method);
+        out += ",\"url\":";
+        detail::appendJsonString(out, e.url);
+        out += ",\"httpVersion\":\"HTTP/1.1\",\"cookies\":[],\"queryString\":[],\"headers\":";
+        headers(out, e.requestHeaders);
+        out += ",\"headersSize\":-1,\"bodySize\":" + std::to_string(e.requestBody.size());
+        if (!e.requestBody.empty()) {
+            out += ",\"postData\":{\"mimeType\":\"\",\"text\":";
+            detail::appendJsonString(out, e.requestBody);
+            out += '}';
+        }
+        out += "},\"response\":{\"status\":" + std::to_string(e.httpCode);
+        out += ",\"statusText\":\"\",\"httpVersion\":\"HTTP/1.1\",\"cookies\":[],\"headers\":";
+        headers(out, e.responseHeaders);
+        out += ",\"content\":{\"size\":" + std::to_string(e.responseBody.size()) + ",\"mimeType\":";
+        detail::appendJsonString(out, mimeType);
+        out += ",\"text\":";
+        content(out, e.responseBody);
+        out += "},\"redirectURL\":\"\",\"headersSize\":-1,\"bodySize\":" + std::to_string(e.responseBody.size());
+        out += "},\"cache\":{},\"timings\":{\"blocked\":-1";
+        out += ",\"dns\":" + phase(0, t.nameLookup);
+        out += ",\"connect\":" + phase(t.nameLookup, t.connect);
+        out += ",\"ssl\":" + phase(t.connect, t.appConnect);
+        out += ",\"send\":" + phase(t.appConnect > 0 ? t.appConnect : t.connect, t.preTransfer);
+        out += ",\"wait\":" + phase(t.preTransfer, t.startTransfer);
+        out += ",\"receive\":" + phase(t.startTransfer, t.total);
+        out += "}}";
+    }
+    out += "]}}";
+    return out;
+}
+
+TrafficRecorder::TrafficRecorder(const std::string& path) : file(std::fopen(path.c_str(), "wb")) {
+    if (!file) {
+        throw CurlingException("Failed to open traffic log for writing: " + path);
+    }
+    std::fwrite(TrafficLog::magic, 1, sizeof(TrafficLog::magic) - 1, file.get());
+    std::fflush(file.get());
+}
+
+void TrafficRecorder::record(const Exchange& exchange) {
+    std::string data;
+    TrafficLog::encode(exchange, data);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::fwrite(data.data(), 1, data.size(), file.get());
+    std::fflush(file.get());
+    ++recorded;
+}
+
+unsigned long TrafficRecorder::count() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return recorded;
+}
+
+ReplayServer::ReplayServer(TrafficLog log, double timeScale, unsigned short port)
+    : log(std::move(log)), timeScale(timeScale) {
+    for (size_t i = 0; i < this->log.exchanges.size(); ++i) {
+        const Exchange& e = this->log.exchanges[i];
+        // Match on the request target only, the replay runs on another host
+        auto schemeEnd = e.url.find("://");
+        auto pathStart = e.url.find('/', schemeEnd == std::string::npos ? 0 : schemeEnd + 3);
+        std::string target = pathStart == std::string::npos ? "/" : e.url.substr(pathStart);
+        routes[e.method + " " + target].push_back(i);
+    }
+
+    listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        throw CurlingException("ReplayServer: failed to create socket");
+    }
+    int yes = 1;
+    ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listenFd, 64) != 0 ||
+        ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        ::close(listenFd);
+        throw CurlingException("ReplayServer: failed to listen on 127.0.0.1:" + std::to_string(port));
+    }
+    listenPort = ntohs(addr.sin_port);
+
+    acceptor = std::thread(&ReplayServer::acceptLoop, this);
+}
+
+ReplayServer::~ReplayServer() noexcept {
+    stopping = true;
+    if (acceptor.joinable()) acceptor.join();
+    for (auto& c : connections) {
+        if (c.thread.joinable()) c.thread.join();
+    }
+    ::close(listenFd);
+}
+
+std::string ReplayServer::url() const {
+    return "http://127.0.0.1:" + std::to_string(listenPort);
+}
+
+const Exchange* ReplayServer::match(const std::string& method, const std::string& target) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = method + " " + target;
+    auto it = routes.find(key);
+    if (it == routes.end()) return nullptr;
+    size_t& cursor = cursors[key];
+    const Exchange* e = &log.exchanges[it->second[cursor % it->second.size()]];
+    ++cursor;
+    return e;
+}
+
+void ReplayServer::acceptLoop() {
+    while (!stopping) {
+        pollfd pfd{listenFd, POLLIN, 0};
+        if (::poll(&pfd, 1, 50) <= 0) continue;
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        // Join the threads of closed connections, long runs open many
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (it->done.load(std::memory_order_acquire)) {
+                it->thread.join();
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        Connection& connection = connections.emplace_back();
+        connection.thread = std::thread([this, fd, &connection] {
+            serveConnection(fd);
+            connection.done.store(true, std::memory_order_release);
+        });
+    }
+}
+
+void ReplayServer::serveConnection(int fd) {
+    auto sendAll = [fd](const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    };
+    auto scaled = [this](curl_off_t us) {
+        return std::chrono::microseconds(static_cast<long long>(std::max<curl_off_t>(us, 0) * timeScale));
+    };
+
+    std::string in;
+    char buffer[16384];
+    bool open = true;
+    while (open && !stopping) {
+        // Read one request head, polling so that shutdown is noticed
+        size_t headEnd;
+        while ((headEnd = in.find("\r\n\r\n")) == std::string::npos) {
+            pollfd pfd{fd, POLLIN, 0};
+            int ready = ::poll(&pfd, 1, 50);
+            if (stopping) { open = false; break; }
+            if (ready <= 0) continue;
+            ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) { open = false; break; }
+            in.append(buffer, static_cast<size_t>(n));
+        }
+        if (!open) break;
+
+        std::istringstream head(in.substr(0, headEnd));
+        std::string method, target, line;
+        head >> method >> target;
+        std::getline(head, line);
+        size_t contentLength = 0;
+        while (std::getline(head, line)) {
+            auto colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = line.substr(0, colon);
+            std::string value = line.substr(colon + 1);
+            detail::toLowerCase(name);
+            detail::trim(value);
+            detail::toLowerCase(value);
+            if (name == "content-length") contentLength = std::strtoul(value.c_str(), nullptr, 10);
+            if (name == "connection" && value == "close") open = false;
+        }
+
+        // Drain the request body
+        in.erase(0, headEnd + 4);
+        while (in.size() < contentLength) {
+            ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) { open = false; break; }
+            in.append(buffer, static_cast<size_t>(n));
+        }
+        if (in.size() < contentLength) break;
+        in.erase(0, contentLength);
+
+        const Exchange* e = match(method, target);
+        ++servedCount;
+        if (!e) {
+            static const char notFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 21\r\n\r\nno recorded exchange\n";
+            if (!sendAll(notFound, sizeof(notFound) - 1)) break;
+            continue;
+        }
+
+        // Recorded server time, then headers
+        std::this_thread::sleep_for(scaled(e->timings.startTransfer - e->timings.preTransfer));
+        std::string response = "HTTP/1.1 " + std::to_string(e->httpCode) + " \r\n";
+        for (const auto& h : e->responseHeaders) {
+            std::string name = h.substr(0, h.find(':'));
+            if (name == "content-length" || name == "transfer-encoding" || name == "connection") continue;
+            response += h + "\r\n";
+        }
+        response += "Content-Length: " + std::to_string(e->responseBody.size()) + "\r\n\r\n";
+        if (!sendAll(response.data(), response.size())) break;
+        if (method == "HEAD") continue;
+
+        // Body paced over the recorded transfer time
+        const std::string& body = e->responseBody;
+        const size_t slice = sizeof(buffer);
+        auto transfer = scaled(e->timings.total - e->timings.startTransfer);
+        auto start = std::chrono::steady_clock::now();
+        bool sent = true;
+        for (size_t offset = 0; sent && offset < body.size(); offset += slice) {
+            size_t n = std::min(slice, body.size() - offset);
+            if (!body.empty() && transfer.count() > 0) {
+                std::this_thread::sleep_until(start + transfer * offset / body.size());
+            }
+            sent = sendAll(body.data() + offset, n);
+        }
+        if (!sent) break;
+    }
+    ::close(fd);
+}
+
 } // namespace curling
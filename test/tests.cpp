@@ -10,9 +10,44 @@
 #include <cstdlib>
 #include <sstream>
 #include <regex>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <new>
 
 int testN{1};
 
+// Allocation counting harness: counts heap allocations made by the current thread.
+// operator new is counted on its own, malloc/calloc/realloc (glibc) also catch
+// what libcurl and operator new allocate underneath.
+namespace allocs {
+thread_local unsigned long news = 0;
+thread_local unsigned long mallocs = 0;
+
+struct Count {
+    unsigned long news, mallocs;
+    static Count now() { return {allocs::news, allocs::mallocs}; }
+    Count operator-(const Count& o) const { return {news - o.news, mallocs - o.mallocs}; }
+};
+} // namespace allocs
+
+void* operator new(std::size_t size) {
+    ++allocs::news;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(std::size_t);
+extern "C" void* __libc_calloc(std::size_t, std::size_t);
+extern "C" void* __libc_realloc(void*, std::size_t);
+extern "C" void* malloc(std::size_t size) { ++allocs::mallocs; return __libc_malloc(size); }
+extern "C" void* calloc(std::size_t n, std::size_t size) { ++allocs::mallocs; return __libc_calloc(n, size); }
+extern "C" void* realloc(void* p, std::size_t size) { ++allocs::mallocs; return __libc_realloc(p, size); }
+#endif
+
 #define OYE std::cout << std::setw(2) << testN++ << " - " << doctest::detail::g_cs->currentTest->m_name << std::endl;
 
 
@@ -24,6 +59,29 @@ TEST_CASE("Library version check") {
     CHECK(version == "1.2.0");
 }
 
+TEST_CASE("Capabilities snapshot reflects the libcurl build") {
+    OYE
+    const curling::Capabilities& caps = curling::capabilities();
+    CHECK(&caps == &curling::capabilities());
+
+    const curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+    CHECK(caps.libcurlVersion == info->version);
+    CHECK(caps.http2 == bool(info->features & CURL_VERSION_HTTP2));
+    CHECK(caps.asyncDns == bool(info->features & CURL_VERSION_ASYNCHDNS));
+
+    curling::Request req;
+    if (caps.http3) {
+        CHECK_NOTHROW(req.setHttpVersion(curling::Request::HttpVersion::HTTP_3));
+    } else {
+        CHECK_THROWS_AS(req.setHttpVersion(curling::Request::HttpVersion::HTTP_3), curling::LogicException);
+    }
+
+    std::ostringstream report;
+    report << caps;
+    CHECK(report.str().find("libcurl: " + caps.libcurlVersion + "\n") == 0);
+    CHECK(report.str().find(std::string("http2: ") + (caps.http2 ? "yes" : "no")) != std::string::npos);
+}
+
 TEST_CASE("Request retries given number of attempts and fails on final one") {
     OYE
     Request req;
@@ -78,6 +136,963 @@ TEST_CASE("Simple Tor proxy test - GET through Tor SOCKS5 proxy") {
 
 
 
+TEST_CASE("Proxy pool prefers healthy, fast proxies and honors concurrency caps") {
+    OYE
+    curling::ProxyPool::Options options;
+    options.policy = curling::ProxyPool::Policy::Fastest;
+    options.maxConcurrentPerProxy = 1;
+    options.maxConsecutiveFailures = 2;
+    curling::ProxyPool pool({"http://proxy-a:3128", "http://proxy-b:3128", "http://proxy-c:3128"}, options);
+
+    // Warm up the scores: a is slow, b is fast, c fails
+    for (int i = 0; i < 3; ++i) {
+        auto lease = pool.acquire();
+        if (lease.proxy() == "http://proxy-a:3128") lease.complete(true, std::chrono::milliseconds(300));
+        else if (lease.proxy() == "http://proxy-b:3128") lease.complete(true, std::chrono::milliseconds(20));
+        else lease.complete(false, std::chrono::milliseconds(10));
+    }
+
+    CHECK(pool.acquire().proxy() == "http://proxy-b:3128");
+
+    // Cap of one lease per proxy: the second pick falls back to the next best
+    auto first = pool.acquire();
+    auto second = pool.acquire();
+    auto third = pool.acquire();
+    CHECK(first.proxy() == "http://proxy-b:3128");
+    CHECK(second.proxy() == "http://proxy-a:3128");
+    CHECK(third.proxy() == "http://proxy-c:3128");
+    CHECK_FALSE(pool.tryAcquire());
+
+    third.complete(false, std::chrono::milliseconds(10));
+    CHECK(pool.stats()[2].benched);
+}
+
+TEST_CASE("Request rotates to another pooled proxy on retry") {
+    OYE
+    auto pool = std::make_shared<curling::ProxyPool>(std::vector<std::string>{
+        "http://127.0.0.1:1", "http://127.0.0.1:2"}); // nothing listens there
+
+    curling::Request req;
+    req.setURL("http://example.com/")
+       .setProxyPool(pool)
+       .setConnectTimeout(1);
+
+    CHECK_THROWS_AS(req.send(2), curling::RequestException);
+
+    auto stats = pool->stats();
+    CHECK(stats[0].failures == 1);
+    CHECK(stats[1].failures == 1);
+    CHECK(stats[0].active == 0);
+}
+
+
+
+TEST_CASE("Mock transport serves canned responses through the regular callbacks") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->httpCode = 201;
+    mock->headers = {"Content-Type: text/plain", "X-Trace: abc", "X-Trace: def"};
+    mock->body = std::string(100000, 'z');
+    mock->chunkSize = 4096;
+
+    curling::Request req;
+    int progressCalls = 0;
+    auto res = req.setMockResponse(mock)
+                  .setURL("http://mock.local/items")
+                  .setProgressCallback([&](curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+                      ++progressCalls;
+                      return false;
+                  })
+                  .send();
+
+    CHECK(res.httpCode == 201);
+    CHECK(res.body == mock->body);
+    CHECK(res.getHeader("content-type") == std::vector<std::string>{"text/plain"});
+    CHECK(res.getHeader("X-Trace").size() == 2);
+    CHECK(progressCalls == 25);
+
+    // Simulated transport failures go through the retry logic
+    auto failing = std::make_shared<curling::MockResponse>();
+    failing->result = CURLE_COULDNT_CONNECT;
+    req.setMockResponse(failing);
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+}
+
+
+namespace {
+struct CountingHooks {
+    static constexpr bool progress = true;
+    static void log(const std::string&) {}
+    bool onProgress(curl_off_t, curl_off_t, curl_off_t, curl_off_t) { ++calls; return false; }
+    int calls = 0;
+};
+} // namespace
+
+TEST_CASE("BasicRequest routes the response through its policies") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->headers = {"Content-Type: text/plain", "X-Trace: abc", "X-Trace: def"};
+    mock->body = std::string(10000, 'q');
+    mock->chunkSize = 1000;
+
+    curling::BasicRequest<curling::StringSink, curling::FlatHeaderStore,
+                          std::allocator<char>, CountingHooks> req;
+    req.setPersistent().setMockResponse(mock).setURL("http://mock.local/items");
+
+    const auto& res = req.send();
+    CHECK(res.httpCode == 200);
+    CHECK(res.body.str() == mock->body);
+    CHECK(res.headers.size() == 3);
+    CHECK(res.headers.get("content-type") == "text/plain");
+    CHECK(res.headers.value(2) == "def");
+    CHECK(req.getHooks().calls == 10);
+
+    // Sink and store keep their memory between sends
+    req.send();
+    auto before = allocs::Count::now();
+    req.send();
+    auto delta = allocs::Count::now() - before;
+    CHECK(delta.news == 0);
+    CHECK(delta.mallocs == 0);
+    CHECK(res.headers.size() == 3);
+
+    // The Request pipeline would leave the policies empty, so it refuses
+    curling::Response plain;
+    CHECK_THROWS_AS(req.Request::send(plain), curling::LogicException);
+
+    curling::BasicRequest<> defaults;
+    defaults.setMockResponse(mock).setURL("http://mock.local/items");
+    const auto& out = defaults.send();
+    CHECK(out.headers.map().at("x-trace").size() == 2);
+}
+
+TEST_CASE("Slab allocator serves response buffers from node-local huge-page slabs") {
+    OYE
+    auto pool = std::make_shared<curling::SlabPool>();
+    curling::SlabAllocator<char> allocator(pool);
+
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->body = std::string(300000, 's');
+    mock->chunkSize = 16384;
+
+    curling::BasicRequest<curling::StringSink, curling::FlatHeaderStore, curling::SlabAllocator<char>> req(allocator);
+    req.setPersistent().setMockResponse(mock).setURL("http://mock.local/slab");
+    const auto& body = req.send().body.str();
+    CHECK(std::string_view(body.data(), body.size()) == mock->body);
+
+    auto stats = pool->stats();
+    CHECK(stats.slabs == 1);
+    CHECK(stats.allocations > 0);
+    CHECK(stats.localAllocations + stats.remoteAllocations + stats.unknownLocality == stats.allocations);
+
+    // Freed blocks are recycled, large blocks get their own mapping
+    void* a = pool->allocate(1000);
+    pool->deallocate(a, 1000);
+    CHECK(pool->allocate(1024) == a);
+    void* big = pool->allocate(3 * 1024 * 1024);
+    CHECK(reinterpret_cast<uintptr_t>(big) % curling::SlabPool::slabSize == 0);
+    pool->deallocate(big, 3 * 1024 * 1024);
+
+    // Rebound copies share the pool; default allocators use the thread's pool
+    curling::SlabAllocator<int> rebound(allocator);
+    CHECK(rebound == allocator);
+    CHECK(curling::SlabAllocator<char>() != allocator);
+    CHECK(curling::SlabAllocator<char>().getPool() == curling::SlabPool::forThisThread());
+}
+
+namespace {
+constexpr char apiVersion[] = "X-Api-Version: 3";
+constexpr char userPostPath[] = "http://mock.local/v1/users/{id}/posts/{slug}";
+} // namespace
+
+TEST_CASE("Static header sets and compile-time routes") {
+    OYE
+    using ApiHeaders = curling::StaticHeaders<curling::headers::acceptJson, apiVersion>;
+    using UserPost = curling::Route<userPostPath>;
+    static_assert(UserPost::parameters == 2);
+    static_assert(!curling::detail::validRoute("/v1/users/{id"));
+    static_assert(!curling::detail::validRoute("/v1/users/{}"));
+    static_assert(!curling::detail::validHeaderLine("Bad Name: x"));
+
+    std::string url;
+    CHECK(UserPost::formatTo(url, 42, "hello world") == "http://mock.local/v1/users/42/posts/hello%20world");
+    CHECK(UserPost::format(7, std::string("a/b")) == "http://mock.local/v1/users/7/posts/a%2Fb");
+
+    const std::string recordingPath = "/tmp/curling_static_headers.bin";
+    std::remove(recordingPath.c_str());
+    auto recorder = std::make_shared<curling::TrafficRecorder>(recordingPath);
+    curling::Request req;
+    req.setMockResponse(std::make_shared<curling::MockResponse>())
+       .setRecorder(recorder)
+       .setURL(url)
+       .addHeader("X-Own: 1")
+       .setStaticHeaders(ApiHeaders::list())
+       .send();
+
+    auto log = curling::TrafficLog::load(recordingPath);
+    REQUIRE(log.exchanges.size() == 1);
+    CHECK(log.exchanges[0].url == url);
+    CHECK(log.exchanges[0].requestHeaders ==
+          std::vector<std::string>{"X-Own: 1", "Accept: application/json", "X-Api-Version: 3"});
+    // The shared list is never relinked
+    CHECK(ApiHeaders::list()->next->next == nullptr);
+    std::remove(recordingPath.c_str());
+}
+
+namespace {
+struct EventLog {
+    std::vector<std::string> events;
+    void onRequest(curling::Request&) { events.push_back("request"); }
+    template<typename Store>
+    void onHeaders(long httpCode, const Store& headers) {
+        events.push_back("headers " + std::to_string(httpCode) + " " + std::string(headers.get("x-trace")));
+    }
+    void onComplete(const curling::Completion& c) { events.push_back("complete " + std::to_string(c.result)); }
+};
+
+struct ByteBudget {
+    size_t budget = 0;
+    bool onChunk(const char*, size_t size) { return (budget -= std::min(budget, size)) > 0; }
+};
+
+class RecordingInterceptor : public curling::Interceptor {
+public:
+    std::vector<std::string> events;
+    size_t bytes = 0;
+    void onRequest(curling::Request& request) override { events.push_back("request"); request.addHeader("X-Plugin: 1"); }
+    void onHeaders(const curling::Response& response) override {
+        events.push_back("headers " + std::to_string(response.httpCode) + " " + response.getHeader("x-trace").at(0));
+    }
+    bool onChunk(const char*, size_t size) override { bytes += size; return true; }
+    void onComplete(const curling::Completion& c) override { events.push_back("complete " + std::to_string(c.attempt)); }
+};
+} // namespace
+
+TEST_CASE("Interceptors run at compile time and at runtime") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->headers = {"X-Trace: abc"};
+    mock->body = std::string(10000, 'i');
+    mock->chunkSize = 1000;
+
+    curling::BasicRequest<curling::StringSink, curling::FlatHeaderStore, std::allocator<char>,
+                          curling::InterceptorChain<EventLog, ByteBudget>> req;
+    req.getHooks().get<1>().budget = 1000000;
+    req.setPersistent().setMockResponse(mock).setURL("http://mock.local/");
+    req.send();
+    CHECK(req.getHooks().get<0>().events == std::vector<std::string>{"request", "headers 200 abc", "complete 0"});
+
+    // A stage returning false from onChunk aborts the transfer
+    req.getHooks().get<1>().budget = 2500;
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+    CHECK(req.getHooks().get<0>().events.back() == "complete " + std::to_string(CURLE_WRITE_ERROR));
+    CHECK(req.response().body.str().size() == 2000);
+
+    // Type-erased plugin on a plain Request
+    auto plugin = std::make_shared<RecordingInterceptor>();
+    curling::Request plain;
+    auto res = plain.setMockResponse(mock).setURL("http://mock.local/").addInterceptor(plugin).send();
+    CHECK(res.body == mock->body);
+    CHECK(plugin->bytes == mock->body.size());
+    CHECK(plugin->events == std::vector<std::string>{"request", "headers 200 abc", "complete 1"});
+}
+
+TEST_CASE("Shared response bodies are sliced and fanned out without copies") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->body = "HEADER|payload-bytes|TRAILER";
+
+    curling::Request req;
+    auto res = req.setMockResponse(mock).setURL("http://mock.local/").send();
+    const char* original = res.body.data();
+    curling::SharedBuffer body = res.shareBody();
+    CHECK(res.body.empty());
+    CHECK(body.data() == original);
+
+    curling::SharedBuffer cached = body;
+    curling::SharedBuffer payload = body.slice(7, 13);
+    CHECK(payload.view() == "payload-bytes");
+    CHECK(payload.data() == original + 7);
+    CHECK(body.useCount() == 3);
+    CHECK(body.slice(100).empty());
+
+    body = curling::SharedBuffer();
+    cached = curling::SharedBuffer();
+    CHECK(payload.useCount() == 1);
+    CHECK(payload.str() == "payload-bytes");
+
+    curling::BasicRequest<curling::StringSink, curling::NoHeaders> policy;
+    policy.setMockResponse(mock).setURL("http://mock.local/");
+    policy.send();
+    curling::SharedBuffer shared = policy.response().body.share();
+    CHECK(shared.view() == mock->body);
+    CHECK(policy.response().body.str().empty());
+}
+
+TEST_CASE("Body is received into caller-provided buffers") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    for (int i = 0; i < 10000; ++i) mock->body.push_back(static_cast<char>('a' + i % 26));
+    mock->chunkSize = 1000;
+
+    // Vectored: fills each buffer in turn, chunks straddle buffer boundaries
+    std::vector<std::byte> first(4096), second(4096), third(4096);
+    curling::Request req;
+    req.setPersistent().setMockResponse(mock).setURL("http://mock.local/blob");
+    req.receiveInto({{first.data(), first.size()}, {second.data(), second.size()}, {third.data(), third.size()}});
+    auto res = req.send();
+    CHECK(res.body.empty());
+    CHECK(req.getReceiveResult().size == 10000);
+    CHECK(std::memcmp(first.data(), mock->body.data(), 4096) == 0);
+    CHECK(std::memcmp(second.data(), mock->body.data() + 4096, 4096) == 0);
+    CHECK(std::memcmp(third.data(), mock->body.data() + 8192, 10000 - 8192) == 0);
+
+    // Overflow policies
+    std::vector<std::byte> small(4096);
+    req.receiveInto(small.data(), small.size(), curling::Request::OverflowPolicy::Truncate);
+    res = req.send();
+    CHECK(req.getReceiveResult().size == 4096);
+    CHECK(req.getReceiveResult().overflow == 10000 - 4096);
+    CHECK(res.body.empty());
+
+    req.receiveInto(small.data(), small.size(), curling::Request::OverflowPolicy::Spill);
+    res = req.send();
+    CHECK(res.body == mock->body.substr(4096));
+
+    req.receiveInto(small.data(), small.size());
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+}
+
+TEST_CASE("Response is pulled through a bounded, pausing stream") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/export";
+    e.httpCode = 200;
+    e.responseHeaders = {"Content-Type: text/csv"};
+    for (int i = 0; i < 50000; ++i) e.responseBody += "row," + std::to_string(i) + "\n";
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+
+    curling::Request req;
+    req.setPersistent().setURL(server.url() + "/export");
+    {
+        auto stream = req.openStream(16 * 1024);
+        CHECK(stream.response().httpCode == 200);
+        CHECK(stream.response().getHeader("content-type") == std::vector<std::string>{"text/csv"});
+
+        std::string received;
+        char chunk[1000];
+        while (size_t n = stream.read(chunk, sizeof(chunk))) received.append(chunk, n);
+        CHECK(received == e.responseBody);
+        CHECK(stream.pauseCount() > 0); // the reader set the pace
+    }
+
+    auto stream = req.openStream(4096);
+    std::string line;
+    int rows = 0;
+    while (std::getline(stream.stream(), line)) {
+        if (line != "row," + std::to_string(rows)) break;
+        ++rows;
+    }
+    CHECK(rows == 50000);
+}
+
+TEST_CASE("BasicRequest streams a response before its first send") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/export";
+    e.httpCode = 200;
+    e.responseHeaders = {"Content-Type: text/csv"};
+    e.responseBody = "a,b\n1,2\n";
+    curling::TrafficLog log;
+    log.exchanges = {e, e};
+    curling::ReplayServer server(log, 0.0);
+
+    curling::BasicRequest<> req;
+    req.setPersistent().setURL(server.url() + "/export");
+    {
+        auto stream = req.openStream();
+        CHECK(stream.response().httpCode == 200);
+        std::string received;
+        char chunk[64];
+        while (size_t n = stream.read(chunk, sizeof(chunk))) received.append(chunk, n);
+        CHECK(received == e.responseBody);
+    }
+    CHECK(req.response().headers.map().at("content-type").front() == "text/csv");
+
+    // Moved requests keep a pipeline pointing at themselves
+    curling::BasicRequest<> moved(std::move(req));
+    CHECK(moved.send().body.str() == e.responseBody);
+}
+
+TEST_CASE("Bulk downloads splice plaintext bodies straight to the file") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/artifact.bin";
+    e.httpCode = 200;
+    e.responseHeaders = {"Content-Type: application/octet-stream"};
+    e.responseBody.resize(4 * 1024 * 1024);
+    for (size_t i = 0; i < e.responseBody.size(); ++i) e.responseBody[i] = static_cast<char>(i * 31 % 251);
+    curling::Exchange encoded = e;
+    encoded.url = "/artifact.gz";
+    encoded.responseHeaders.push_back("Content-Encoding: gzip");
+    curling::TrafficLog log;
+    log.exchanges = {e, encoded};
+    curling::ReplayServer server(log, 0.0);
+
+    const std::string path = "/tmp/curling_bulk_download.bin";
+    auto readFile = [&] {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+
+    curling::Request req;
+    req.setPersistent().setBulkDownload().setURL(server.url() + "/artifact.bin").downloadToFile(path);
+    auto res = req.send();
+    CHECK(res.httpCode == 200);
+    CHECK(req.getDownloadPath() == curling::Request::TransferPath::Splice);
+    CHECK(readFile() == e.responseBody);
+
+    // Content-encoded responses keep the regular path
+    req.setURL(server.url() + "/artifact.gz");
+    req.send();
+    CHECK(req.getDownloadPath() == curling::Request::TransferPath::Copy);
+    CHECK(readFile() == e.responseBody);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Spliced downloads honour the request timeout and the progress abort") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/slow.bin";
+    e.httpCode = 200;
+    e.responseBody.assign(4 * 1024 * 1024, 'x');
+    e.timings.startTransfer = 0;
+    e.timings.total = 4000000; // body paced over four seconds
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 1.0);
+    const std::string path = "/tmp/curling_bulk_slow.bin";
+    using Clock = std::chrono::steady_clock;
+
+    curling::Request req;
+    req.setBulkDownload().setTimeout(1).setURL(server.url() + "/slow.bin").downloadToFile(path);
+    auto start = Clock::now();
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+    CHECK(Clock::now() - start < std::chrono::milliseconds(2500));
+
+    curling::Request cancelled;
+    cancelled.setBulkDownload()
+        .setProgressCallback([](curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t) { return dlnow > 256 * 1024; })
+        .setURL(server.url() + "/slow.bin")
+        .downloadToFile(path);
+    start = Clock::now();
+    CHECK_THROWS_AS(cancelled.send(), curling::RequestException);
+    CHECK(Clock::now() - start < std::chrono::milliseconds(2500));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("File uploads use sendfile on plaintext connections") {
+    OYE
+    curling::Exchange e;
+    e.method = "PUT";
+    e.url = "/upload";
+    e.httpCode = 201;
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+
+    const std::string path = "/tmp/curling_upload.bin";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << std::string(3 * 1024 * 1024 + 17, 'u');
+    }
+
+    curling::Request req;
+    req.setPersistent().setURL(server.url() + "/upload").uploadFile(path);
+    CHECK(req.send().httpCode == 201);
+    // libcurl 8.7+ rejects a body that bypasses its read callback, so the mmap path is taken there
+    CHECK(req.getUploadPath() == (LIBCURL_VERSION_NUM < 0x080700 ? curling::Request::TransferPath::Sendfile
+                                                                  : curling::Request::TransferPath::Mmap));
+
+    // The same connection keeps working, and the mmap fallback sends the same request
+    req.uploadFile(path, false);
+    CHECK(req.send().httpCode == 201);
+    CHECK(req.getUploadPath() == curling::Request::TransferPath::Mmap);
+    CHECK(server.served() == 2);
+
+    req.uploadFile("/tmp/curling_missing_upload.bin");
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Sendfile uploads honour the request timeout and the progress abort") {
+    OYE
+    // A listener that never accepts: the kernel takes a few MB, then the upload stalls
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    REQUIRE(::listen(listener, 4) == 0);
+    socklen_t len = sizeof(addr);
+    ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len);
+    const std::string url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/upload";
+
+    const std::string path = "/tmp/curling_upload_stall.bin";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << std::string(32 * 1024 * 1024, 'u');
+    }
+    using Clock = std::chrono::steady_clock;
+
+    // libcurl waits a second for 100-continue before the body goes out
+    curling::Request req;
+    req.setTimeout(2).setURL(url).uploadFile(path);
+    auto start = Clock::now();
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+    CHECK(Clock::now() - start < std::chrono::milliseconds(3500));
+
+    curling::Request cancelled;
+    cancelled.setProgressCallback([](curl_off_t, curl_off_t, curl_off_t, curl_off_t ulnow) { return ulnow > 256 * 1024; })
+        .setURL(url)
+        .uploadFile(path);
+    start = Clock::now();
+    CHECK_THROWS_AS(cancelled.send(), curling::RequestException);
+    CHECK(Clock::now() - start < std::chrono::milliseconds(3500));
+    ::close(listener);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Resolver pool feeds lookups to libcurl off the transfer thread") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/resolved";
+    e.httpCode = 200;
+    e.responseBody = "ok";
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+
+    std::string url = server.url() + "/resolved";
+    url.replace(url.find("127.0.0.1"), 9, "localhost");
+
+    auto pool = std::make_shared<curling::ResolverPool>(2);
+    curling::Request req;
+    req.setPersistent().setResolverPool(pool).setConnectTimeout(5).setURL(url);
+    auto res = req.send();
+    CHECK(res.httpCode == 200);
+    CHECK(res.body == "ok");
+    CHECK(pool->stats().lookups == 1);
+
+    // Literal addresses skip the pool
+    req.setURL(server.url() + "/resolved");
+    CHECK(req.send().httpCode == 200);
+    CHECK(pool->stats().lookups == 1);
+
+    req.setURL("http://no-such-host.invalid/");
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+    CHECK(pool->stats().failures <= 1);
+
+    CHECK_THROWS_AS(curling::ResolverPool(0), curling::LogicException);
+}
+
+TEST_CASE("DNS cache serves repeated lookups, caches failures and refreshes ahead") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/cached";
+    e.httpCode = 200;
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+    std::string url = server.url() + "/cached";
+    url.replace(url.find("127.0.0.1"), 9, "localhost");
+
+    auto resolver = std::make_shared<curling::ResolverPool>(1);
+    auto cache = std::make_shared<curling::DnsCache>(resolver);
+    for (int i = 0; i < 3; ++i) {
+        curling::Request req; // fresh handle each time
+        CHECK(req.setDnsCache(cache).setURL(url).send().httpCode == 200);
+    }
+    auto stats = cache->stats();
+    CHECK(stats.misses == 1);
+    CHECK(stats.hits == 2);
+    CHECK(stats.entries == 1);
+    CHECK(resolver->stats().lookups == 1);
+
+    cache->lookup("no-such-host.invalid", "80").wait();
+    CHECK_THROWS_AS(cache->lookup("no-such-host.invalid", "80").get(), curling::RequestException);
+    CHECK(cache->stats().negativeHits == 1);
+
+    // Every hit falls in the refresh window: old addresses are served while the refresh runs
+    curling::DnsCache::Options options;
+    options.ttl = std::chrono::seconds(60);
+    options.refreshAhead = std::chrono::seconds(60);
+    options.maxEntries = 1;
+    curling::DnsCache eager(resolver, options);
+    eager.lookup("localhost", "80").wait();
+    CHECK(!eager.lookup("localhost", "80").get().empty());
+    CHECK(eager.stats().refreshes == 1);
+
+    eager.prefetch("127.0.0.1", "80");
+    CHECK(eager.stats().entries == 1);
+
+    options.maxEntries = 0;
+    CHECK_THROWS_AS(curling::DnsCache(resolver, options), curling::LogicException);
+}
+
+TEST_CASE("Socket options apply to new connections and compose with bulk downloads") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/tuned";
+    e.httpCode = 200;
+    e.responseBody.assign(1024 * 1024, 't');
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+
+    std::vector<std::string> messages;
+    curling::setLogHandler([&](const std::string& message) { messages.push_back(message); });
+
+    curling::SocketOptions options;
+    options.receiveBuffer = 1 << 20;
+    options.sendBuffer = 256 * 1024;
+    options.tos = curling::SocketOptions::dscp(10);
+    options.strict = true;
+    static_assert(curling::SocketOptions::dscp(46) == 0xb8);
+
+    curling::Request req;
+    req.setPersistent().setSocketOptions(options).setURL(server.url() + "/tuned");
+    CHECK(req.send().body == e.responseBody);
+
+    const std::string path = "/tmp/curling_socket_options.bin";
+    req.setBulkDownload().downloadToFile(path);
+    CHECK(req.send().httpCode == 200);
+    CHECK(req.getDownloadPath() == curling::Request::TransferPath::Splice);
+    std::remove(path.c_str());
+    CHECK(messages.empty());
+    curling::setLogHandler(nullptr);
+
+    // Binding to an address this host does not have fails the connection
+    options.interface = "host!192.0.2.1";
+    curling::Request bound;
+    bound.setSocketOptions(options).setURL(server.url() + "/tuned");
+    CHECK_THROWS_AS(bound.send(), curling::RequestException);
+}
+
+TEST_CASE("Source address pool spreads attempts across local addresses with host affinity") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/egress";
+    e.httpCode = 200;
+    curling::TrafficLog log;
+    log.exchanges.assign(8, e);
+    curling::ReplayServer server(log, 0.0);
+
+    auto pool = std::make_shared<curling::SourceAddressPool>(std::vector<std::string>{"127.0.0.1", "127.0.0.2"});
+    for (int i = 0; i < 4; ++i) {
+        curling::Request req;
+        CHECK(req.setSourceAddressPool(pool).setURL(server.url() + "/egress").send().httpCode == 200);
+    }
+    auto stats = pool->stats();
+    CHECK(stats[0].requests == 2);
+    CHECK(stats[1].requests == 2);
+    CHECK(stats[0].connections == 2);
+    CHECK(stats[1].connections == 2);
+
+    // A persistent request keeps its address, and its connection
+    curling::Request sticky;
+    sticky.setPersistent().setSourceAddressPool(pool).setURL(server.url() + "/egress");
+    for (int i = 0; i < 3; ++i) CHECK(sticky.send().httpCode == 200);
+    stats = pool->stats();
+    CHECK(stats[0].requests + stats[1].requests == 7);
+    CHECK(stats[0].connections + stats[1].connections == 5);
+    CHECK((stats[0].requests == 5 || stats[1].requests == 5));
+    CHECK(stats[0].active + stats[1].active == 0);
+
+    // A retry moves off an address that cannot be bound, then the request sticks to the one that worked
+    auto partial = std::make_shared<curling::SourceAddressPool>(std::vector<std::string>{"192.0.2.1", "127.0.0.1"});
+    curling::Request retried;
+    retried.setPersistent().setSourceAddressPool(partial).setURL(server.url() + "/egress");
+    CHECK(retried.send(2).httpCode == 200);
+    CHECK(retried.send().httpCode == 200);
+    stats = partial->stats();
+    CHECK(stats[0].requests == 1);
+    CHECK(stats[1].requests == 2);
+
+    CHECK_THROWS_AS(curling::SourceAddressPool({}), curling::LogicException);
+}
+
+TEST_CASE("In-flight registry lists running transfers as JSON") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/slow?q=%22x%22";
+    e.httpCode = 200;
+    e.responseBody.assign(64 * 1024, 'r');
+    e.timings.preTransfer = 1000;
+    e.timings.startTransfer = 400000;
+    e.timings.total = 600000;
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log);
+
+    auto registry = std::make_shared<curling::InFlightRegistry>(4);
+    curling::setInFlightRegistry(registry);
+    CHECK(curling::inFlightRegistry() == registry);
+
+    std::thread worker([&] {
+        curling::Request req;
+        req.setURL(server.url() + "/slow").addArg("q", "\"x\"");
+        req.send();
+    });
+    std::vector<curling::InFlightRegistry::Transfer> seen;
+    for (int i = 0; i < 200 && seen.empty(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        seen = registry->snapshot();
+        if (!seen.empty() && seen[0].connectionId < 0) seen.clear(); // wait until connected
+    }
+    std::string json = registry->toJson();
+    worker.join();
+    curling::setInFlightRegistry(nullptr);
+
+    REQUIRE(seen.size() == 1);
+    CHECK(seen[0].url == server.url() + "/slow?q=%22x%22");
+    CHECK(seen[0].attempt == 1);
+    CHECK(seen[0].phase != curling::InFlightRegistry::Phase::Resolving);
+    CHECK(json.find("\"url\":\"" + server.url() + "/slow?q=%22x%22\"") != std::string::npos);
+    CHECK(json.find("\"attempt\":1") != std::string::npos);
+    CHECK(registry->snapshot().empty());
+    CHECK(registry->toJson() == "{\"dropped\":0,\"transfers\":[]}");
+    CHECK(curling::inFlightRegistry() == nullptr);
+}
+
+#ifdef CURLING_SDT_STUB
+TEST_CASE("USDT probes keep header callbacks working and unhook from moved requests") {
+    OYE
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/probed";
+    e.httpCode = 200;
+    e.responseHeaders = {"X-Probe: yes"};
+    e.responseBody = "probed";
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+    curling::ReplayServer other(log, 0.0);
+
+    struct HeaderSeen : curling::Interceptor {
+        std::vector<std::string> values;
+        void onHeaders(const curling::Response& response) override { values = response.getHeader("x-probe"); }
+    };
+    auto seen = std::make_shared<HeaderSeen>();
+    const unsigned firstBytes = sdt_stub::count("first__byte");
+    const unsigned connects = sdt_stub::count("connect__done");
+
+    curling::Request req;
+    req.setPersistent().addInterceptor(seen).setURL(server.url() + "/probed");
+    auto res = req.send();
+    CHECK(res.httpCode == 200);
+    CHECK(res.getHeader("x-probe") == std::vector<std::string>{"yes"});
+    CHECK(seen->values == std::vector<std::string>{"yes"});
+    CHECK(res.body == "probed");
+    CHECK(sdt_stub::count("first__byte") == firstBytes + 1);
+    CHECK(sdt_stub::count("connect__done") == connects + 1);
+
+    curling::BasicRequest<> basic;
+    basic.setURL(server.url() + "/probed");
+    CHECK(basic.send().body.str() == "probed");
+    CHECK(basic.response().headers.map().at("x-probe").front() == "yes");
+    CHECK(sdt_stub::count("first__byte") == firstBytes + 2);
+
+    // The handle outlives the moved-from request: a prereq callback left on it would
+    // write into that request's storage when the stream opens a new connection
+    alignas(curling::Request) unsigned char storage[sizeof(curling::Request)];
+    auto* source = new (storage) curling::Request;
+    source->setPersistent().setURL(server.url() + "/probed");
+    CHECK(source->send().httpCode == 200);
+    curling::Request moved(std::move(*source));
+    source->~Request();
+    std::memset(storage, 0, sizeof(storage));
+    moved.setURL(other.url() + "/probed");
+    {
+        auto stream = moved.openStream();
+        CHECK(stream.response().httpCode == 200);
+        std::string received;
+        char chunk[64];
+        while (size_t n = stream.read(chunk, sizeof(chunk))) received.append(chunk, n);
+        CHECK(received == "probed");
+    }
+    CHECK(std::all_of(std::begin(storage), std::end(storage), [](unsigned char b) { return b == 0; }));
+    CHECK(sdt_stub::count("connect__done") == connects + 3);
+}
+#endif
+
+TEST_CASE("Slow requests are kept in a bounded ring and logged with their timings") {
+    OYE
+    curling::Exchange slow;
+    slow.method = "GET";
+    slow.url = "/slow";
+    slow.httpCode = 200;
+    slow.responseBody = "late";
+    slow.timings.preTransfer = 1000;
+    slow.timings.startTransfer = 150000;
+    slow.timings.total = 150000;
+    curling::Exchange fast = slow;
+    fast.url = "/fast";
+    fast.timings = curling::Exchange::Timings{};
+    curling::TrafficLog log;
+    log.exchanges = {slow, slow, slow, fast};
+    curling::ReplayServer server(log);
+
+    std::vector<std::string> lines;
+    curling::setLogHandler([&](const std::string& line) { lines.push_back(line); });
+
+    auto slowLog = std::make_shared<curling::SlowRequestLog>(std::chrono::milliseconds(100), 2);
+    curling::Request req;
+    req.setPersistent().setSlowRequestLog(slowLog);
+    for (int i = 0; i < 3; ++i) CHECK(req.setURL(server.url() + "/slow").send().body == "late");
+    CHECK(req.setURL(server.url() + "/fast").send().httpCode == 200);
+
+    CHECK(slowLog->total() == 3);
+    auto records = slowLog->records();
+    REQUIRE(records.size() == 2);
+    CHECK(records[1].url == server.url() + "/slow");
+    CHECK(records[1].elapsed >= std::chrono::milliseconds(100));
+    CHECK(records[1].timings.startTransfer >= 100000);
+    CHECK(records[1].reusedConnection);
+    CHECK(records[1].bytesReceived == 4);
+    CHECK(records[1].attempts.size() == 1);
+    CHECK(lines.size() == 3);
+
+    // Retry history of a failed send
+    curling::Request refused;
+    refused.setSlowRequestLog(slowLog).setURL("http://127.0.0.1:1/");
+    CHECK_THROWS_AS(refused.send(2), curling::RequestException);
+    records = slowLog->records();
+    CHECK(records.back().attempts.size() == 2);
+    CHECK(records.back().result == CURLE_COULDNT_CONNECT);
+    CHECK(lines.back().find("Slow request: GET http://127.0.0.1:1/ -> 0") == 0);
+    curling::setLogHandler(nullptr);
+}
+
+TEST_CASE("Cost accounting measures CPU and curling allocations per endpoint") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->body = std::string(200000, 'c');
+    mock->chunkSize = 16384;
+    auto ledger = std::make_shared<curling::CostLedger>();
+
+    curling::BasicRequest<curling::StringSink, curling::FlatHeaderStore, curling::SlabAllocator<char>> slab;
+    slab.setPersistent().setCostLedger(ledger).setMockResponse(mock);
+    for (int i = 0; i < 3; ++i) {
+        slab.setURL("http://mock.local/v1/items?page=" + std::to_string(i));
+        const auto& res = slab.send();
+        CHECK(res.usage.cpu.count() > 0);
+        if (i == 0) {
+            CHECK(res.usage.allocatedBytes >= mock->body.size());
+        } else {
+            CHECK(res.usage.allocations == 0); // body capacity reused
+        }
+    }
+
+    curling::Request plain;
+    plain.setPersistent().setCostLedger(ledger, "POST items").setMockResponse(mock)
+         .setMethod(curling::Request::Method::POST).setURL("http://mock.local/v1/items");
+    auto res = plain.send();
+    CHECK(res.usage.cpu.count() > 0);
+    CHECK(res.usage.allocatedBytes == 0); // std::string body, not a curling allocator
+
+    auto entries = ledger->entries();
+    REQUIRE(entries.size() == 2);
+    auto items = std::find_if(entries.begin(), entries.end(), [](const auto& e) { return e.key == "GET /v1/items"; });
+    REQUIRE(items != entries.end());
+    CHECK(items->requests == 3);
+    CHECK(items->cpuPerRequest() <= items->cpu);
+    CHECK(entries[0].cpu >= entries[1].cpu);
+
+    // Accounting off: usage stays zero
+    curling::Request quiet;
+    quiet.setMockResponse(mock).setURL("http://mock.local/v1/items");
+    CHECK(quiet.send().usage.cpu.count() == 0);
+}
+
+TEST_CASE("HDR histograms give accurate percentiles, merge across threads and round-trip") {
+    OYE
+    curling::HdrHistogram h(3600ULL * 1000 * 1000, 3);
+    for (std::uint64_t v = 1; v <= 10000; ++v) h.record(v);
+    CHECK(h.count() == 10000);
+    CHECK(h.min() == 1);
+    CHECK(h.max() == 10000);
+    CHECK(h.mean() == doctest::Approx(5000.5));
+    CHECK(h.percentile(50.0) == doctest::Approx(5000).epsilon(0.001));
+    CHECK(h.percentile(99.0) == doctest::Approx(9900).epsilon(0.001));
+    CHECK(h.percentile(100.0) == 10000);
+    h.record(90ULL * 1000 * 1000); // a 90 s outlier keeps three digits
+    CHECK(h.percentile(100.0) == doctest::Approx(90e6).epsilon(0.001));
+
+    auto copy = curling::HdrHistogram::deserialize(h.serialize());
+    CHECK(copy.count() == h.count());
+    CHECK(copy.percentile(99.9) == h.percentile(99.9));
+    CHECK(copy.serialize() == h.serialize());
+    CHECK_THROWS_AS(curling::HdrHistogram::deserialize("HDR1 10 3 x"), curling::LogicException);
+    CHECK_THROWS_AS(h.merge(curling::HdrHistogram(1000, 2)), curling::LogicException);
+
+    curling::ShardedHistogram sharded(1000ULL * 1000, 2, 4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&sharded, t] {
+            for (std::uint64_t v = 0; v < 25000; ++v) sharded.record(t == 3 ? 5000000 : v % 1000);
+        });
+    }
+    for (auto& t : threads) t.join();
+    auto merged = sharded.snapshot();
+    CHECK(merged.count() == 100000);
+    CHECK(merged.max() == 1000ULL * 1000); // clamped to the trackable range
+    CHECK(merged.percentile(50.0) == doctest::Approx(666).epsilon(0.01));
+    merged.merge(merged);
+    CHECK(merged.count() == 200000);
+    sharded.reset();
+    CHECK(sharded.snapshot().count() == 0);
+
+    // Phase latencies per host from real transfers
+    curling::Exchange slow;
+    slow.method = "GET";
+    slow.url = "/slow";
+    slow.httpCode = 200;
+    slow.responseBody = "late";
+    slow.timings.preTransfer = 1000;
+    slow.timings.startTransfer = 30000;
+    slow.timings.total = 30000;
+    curling::TrafficLog log;
+    log.exchanges = {slow, slow, slow};
+    curling::ReplayServer server(log);
+    auto tracker = std::make_shared<curling::LatencyTracker>();
+    curling::Request req;
+    req.setPersistent().setLatencyTracker(tracker).setURL(server.url() + "/slow");
+    for (int i = 0; i < 3; ++i) CHECK(req.send().httpCode == 200);
+
+    auto hosts = tracker->hosts();
+    REQUIRE(hosts.size() == 1);
+    CHECK(hosts[0] == server.url().substr(std::string("http://").size()));
+    auto ttfb = tracker->histogram(hosts[0], curling::LatencyTracker::Phase::FirstByte);
+    CHECK(ttfb.count() == 3);
+    CHECK(ttfb.min() >= 25000);
+    CHECK(tracker->histogram(hosts[0], curling::LatencyTracker::Phase::Connect).count() == 1); // one connection
+    CHECK(tracker->histogram(hosts[0], curling::LatencyTracker::Phase::Tls).count() == 0);
+    CHECK(tracker->report().find(hosts[0] + " ttfb us: count 3") != std::string::npos);
+}
 
 TEST_CASE("Progress callback aborts download") {
     OYE
@@ -432,6 +1447,25 @@ TEST_CASE("GET request test with Digest authorization method with integrity prot
 
 TEST_SUITE("testing HTTP methods"){
 
+TEST_CASE("Persistent Request reuses Digest auth state across sends") {
+    OYE
+    curling::Request req;
+    req.setPersistent()
+       .setURL("https://httpbin.org/digest-auth/auth/myusername/mypassword")
+       .setHttpAuth("myusername", "mypassword")
+       .setHttpAuthMethod(curling::Request::AuthMethod::DIGEST)
+       .enableVerbose(false);
+
+    for (int i = 0; i < 3; ++i) {
+        auto res = req.send();
+        CHECK(res.httpCode == 200);
+    }
+
+    // Only the first send goes through the 401 challenge
+    CHECK(req.getAuthStats().challenges == 1);
+    CHECK(req.getAuthStats().challengesAvoided == 2);
+}
+
 TEST_CASE("GET request test") {
     OYE
     curling::Request req;
@@ -636,3 +1670,178 @@ TEST_CASE("Force HTTP/2 version") {
     auto res = req.send();
     CHECK(res.httpCode == 200);
 }
+
+TEST_CASE("Refreshing token provider refreshes in the background with single-flight fetches") {
+    OYE
+    std::atomic<int> fetches{0};
+    auto provider = std::make_shared<curling::RefreshingTokenProvider>([&fetches] {
+        int n = ++fetches;
+        curling::waitMs(50); // slow token endpoint
+        return curling::Token{"token-" + std::to_string(n),
+                              std::chrono::steady_clock::now() + std::chrono::milliseconds(400)};
+    }, std::chrono::seconds(60), std::chrono::milliseconds(50));
+
+    // Concurrent first use shares a single fetch
+    std::vector<std::thread> threads;
+    std::vector<std::string> tokens(8);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        threads.emplace_back([&, i] { tokens[i] = provider->token(); });
+    }
+    for (auto& t : threads) t.join();
+
+    CHECK(fetches == 1);
+    for (const auto& t : tokens) CHECK(t == "token-1");
+
+    // Short-lived token gets refreshed ahead of expiry without any caller waiting on it
+    curling::waitMs(350);
+    CHECK(provider->refreshCount() >= 2);
+    CHECK(provider->token() != "token-1");
+}
+
+TEST_CASE("Refreshing token provider keeps a minimum interval between background refreshes") {
+    OYE
+    std::atomic<int> fetches{0};
+    // A misbehaving endpoint hands out tokens that are already expired
+    auto provider = std::make_shared<curling::RefreshingTokenProvider>([&fetches] {
+        ++fetches;
+        return curling::Token{"stale", std::chrono::steady_clock::now() - std::chrono::seconds(1)};
+    }, std::chrono::seconds(60), std::chrono::milliseconds(100));
+
+    curling::waitMs(350);
+    CHECK(fetches >= 2);
+    CHECK(fetches <= 5);
+}
+
+TEST_CASE("Non-persistent send with a token provider and user headers frees each header once") {
+    OYE
+    auto provider = std::make_shared<curling::RefreshingTokenProvider>([] {
+        return curling::Token{"token", std::chrono::steady_clock::now() + std::chrono::hours(1)};
+    });
+    curling::Request req;
+    req.setTokenProvider(provider).addHeader("X-Trace: 1").setURL("http://127.0.0.1:1/");
+    CHECK_THROWS_AS(req.send(), curling::RequestException); // reset() runs on the final failure
+
+    // The request is reusable afterwards
+    req.setTokenProvider(provider).addHeader("X-Trace: 2").setURL("http://127.0.0.1:1/");
+    CHECK_THROWS_AS(req.send(), curling::RequestException);
+}
+
+TEST_CASE("Traffic is recorded, replayed with its timing and exported as HAR") {
+    OYE
+    const std::string recordingPath = "/tmp/curling_recording.bin";
+    const std::string replayPath = "/tmp/curling_replay.bin";
+
+    // A recorded exchange with 80ms of server time
+    curling::Exchange recorded;
+    recorded.method = "GET";
+    recorded.url = "https://api.example.com/v1/users/42?fields=name";
+    recorded.httpCode = 200;
+    recorded.responseHeaders = {"content-type: application/json"};
+    recorded.responseBody = R"({"id":42,"name":"Ada"})";
+    recorded.timings.preTransfer = 10000;
+    recorded.timings.startTransfer = 90000;
+    recorded.timings.total = 95000;
+    curling::TrafficLog original;
+    original.exchanges.push_back(recorded);
+    original.save(replayPath);
+
+    curling::ReplayServer server(curling::TrafficLog::load(replayPath));
+    auto recorder = std::make_shared<curling::TrafficRecorder>(recordingPath);
+
+    curling::Request req;
+    auto start = std::chrono::steady_clock::now();
+    auto res = req.setURL(server.url() + "/v1/users/42")
+                  .addArg("fields", "name")
+                  .setAuthToken("secret")
+                  .setRecorder(recorder)
+                  .send();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    CHECK(res.httpCode == 200);
+    CHECK(res.body == recorded.responseBody);
+    CHECK(res.getHeader("content-type") == std::vector<std::string>{"application/json"});
+    CHECK(elapsed >= std::chrono::milliseconds(75));
+
+    // Unknown requests are answered with a 404
+    CHECK(req.setURL(server.url() + "/v1/unknown").send().httpCode == 404);
+    CHECK(server.served() == 2);
+
+    // The live exchange was recorded with its timings, credentials redacted
+    CHECK(recorder->count() == 1);
+    auto log = curling::TrafficLog::load(recordingPath);
+    REQUIRE(log.exchanges.size() == 1);
+    const auto& e = log.exchanges[0];
+    CHECK(e.method == "GET");
+    CHECK(e.url == server.url() + "/v1/users/42?fields=name");
+    CHECK(e.responseBody == recorded.responseBody);
+    CHECK(e.timings.startTransfer >= 75000);
+    CHECK(e.timings.total >= e.timings.startTransfer);
+    CHECK(e.requestHeaders == std::vector<std::string>{"Authorization: [redacted]"});
+
+    std::string har = log.toHar();
+    CHECK(har.find("\"version\":\"1.2\"") != std::string::npos);
+    CHECK(har.find("\"mimeType\":\"application/json\"") != std::string::npos);
+    CHECK(har.find("secret") == std::string::npos);
+
+    std::filesystem::remove(recordingPath);
+    std::filesystem::remove(replayPath);
+}
+
+TEST_CASE("Persistent Request reaches a zero-allocation steady state") {
+    OYE
+    auto mock = std::make_shared<curling::MockResponse>();
+    mock->headers = {"Content-Type: application/json", "Cache-Control: no-cache, no-store, must-revalidate",
+                     "X-Request-Id: 0f8fad5b-d9cb-469f-a165-70867728950e"};
+    mock->body = std::string(8192, 'b');
+
+    curling::Request req;
+    req.setPersistent()
+       .setMockResponse(mock)
+       .setURL("http://mock.local/v1/items")
+       .addHeader("Accept: application/json");
+
+    curling::Response res;
+    auto sendTemplated = [&] {
+        req.clearArgs().addArg("page", "2").addArg("sort", "name");
+        req.send(res);
+    };
+    for (int i = 0; i < 3; ++i) sendTemplated(); // warm-up
+
+    auto before = allocs::Count::now();
+    for (int i = 0; i < 100; ++i) sendTemplated();
+    auto delta = allocs::Count::now() - before;
+
+    CHECK(delta.news == 0);
+    CHECK(delta.mallocs == 0);
+    CHECK(res.httpCode == 200);
+    CHECK(res.body == mock->body);
+    CHECK(res.getHeader("x-request-id").size() == 1);
+
+    // Over real sockets libcurl allocates internally, curling itself still doesn't
+    curling::Exchange e;
+    e.method = "GET";
+    e.url = "/v1/items?page=2&sort=name";
+    e.httpCode = 200;
+    e.responseHeaders = mock->headers;
+    e.responseBody = mock->body;
+    curling::TrafficLog log;
+    log.exchanges.push_back(e);
+    curling::ReplayServer server(log, 0.0);
+
+    curling::Request live;
+    live.setPersistent().setURL(server.url() + "/v1/items");
+    for (int i = 0; i < 3; ++i) {
+        live.clearArgs().addArg("page", "2").addArg("sort", "name");
+        live.send(res);
+    }
+    before = allocs::Count::now();
+    for (int i = 0; i < 20; ++i) {
+        live.clearArgs().addArg("page", "2").addArg("sort", "name");
+        live.send(res);
+    }
+    delta = allocs::Count::now() - before;
+
+    CHECK(delta.news == 0);
+    CHECK(res.httpCode == 200);
+    CHECK(res.body == mock->body);
+}